@@ -0,0 +1,108 @@
+/*
+
+camera - times bsp2bmp's move of a vertex list into camera space: the
+generic to_camera() with its switch per vertex, then the bounds, against
+the per-axis kernels camera_list() picks once per render
+
+Built and run by "make bench". bsp2bmp.c is included whole, so these
+are the functions the program itself uses.
+
+*/
+
+#define main bsp2bmp_main
+#include "../bsp2bmp.c"
+#undef main
+
+#define BENCH_VERTS  4000000
+#define BENCH_RUNS   10
+
+/* What the render loop did before the kernels: each vertex through
+   to_camera(), and the bounds kept as it goes */
+void generic_list(struct vertex_t *v, long num, int camera_axis, struct vertex_t *lo, struct vertex_t *hi) {
+	long	i;
+
+	lo->X = lo->Y = lo->Z = 0.0;
+	*hi = *lo;
+	for (i=0; i<num; i++) {
+		to_camera(&v[i], camera_axis);
+		if (i == 0) {
+			*lo = *hi = v[i];
+			continue;
+		}
+		if (v[i].X < lo->X)
+			lo->X = v[i].X;
+		if (v[i].X > hi->X)
+			hi->X = v[i].X;
+		if (v[i].Y < lo->Y)
+			lo->Y = v[i].Y;
+		if (v[i].Y > hi->Y)
+			hi->Y = v[i].Y;
+		if (v[i].Z < lo->Z)
+			lo->Z = v[i].Z;
+		if (v[i].Z > hi->Z)
+			hi->Z = v[i].Z;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	static int	 axes[6] = { -1, 1, -2, 2, -3, 3 };
+	struct vertex_t	*src, *v1, *v2, lo1, hi1, lo2, hi2;
+	double		 t0, best1, best2, sum1 = 0.0, sum2 = 0.0;
+	long		 i, num = BENCH_VERTS;
+	int		 a, r, ret = 0;
+
+	if (argc > 1)
+		num = atol(argv[1]);
+	if (num < 1)
+		num = BENCH_VERTS;
+
+	src = malloc(sizeof(struct vertex_t) * num);
+	v1 = malloc(sizeof(struct vertex_t) * num);
+	v2 = malloc(sizeof(struct vertex_t) * num);
+	if (src == NULL || v1 == NULL || v2 == NULL) {
+		fprintf(stderr,"Error allocating vertex lists.\n");
+		return 2;
+	}
+
+	/* map sized coordinates, the same every run */
+	srand(1);
+	for (i=0; i<num; i++) {
+		src[i].X = (float)(rand() % 8192 - 4096) + (float)(rand() % 8) / 8.0;
+		src[i].Y = (float)(rand() % 8192 - 4096) + (float)(rand() % 8) / 8.0;
+		src[i].Z = (float)(rand() % 8192 - 4096) + (float)(rand() % 8) / 8.0;
+	}
+
+	printf("%ld vertices, best of %d runs (ms):\n", num, BENCH_RUNS);
+	printf("  axis  generic  per-axis\n");
+	for (a=0; a<6; a++) {
+		best1 = best2 = HUGE_VAL;
+		for (r=0; r<BENCH_RUNS; r++) {
+			memcpy(v1, src, sizeof(struct vertex_t) * num);
+			t0 = timer();
+			generic_list(v1, num, axes[a], &lo1, &hi1);
+			best1 = fmin(best1, timer() - t0);
+
+			memcpy(v2, src, sizeof(struct vertex_t) * num);
+			t0 = timer();
+			camera_list(v2, num, axes[a], &lo2, &hi2);
+			best2 = fmin(best2, timer() - t0);
+		}
+
+		/* no use being fast if the answer is different */
+		if (memcmp(v1, v2, sizeof(struct vertex_t) * num) != 0 ||
+		    memcmp(&lo1, &lo2, sizeof(lo1)) != 0 || memcmp(&hi1, &hi2, sizeof(hi1)) != 0) {
+			fprintf(stderr,"Error: axis %d, the kernel and to_camera() differ.\n",axes[a]);
+			ret = 1;
+		}
+
+		printf("  %+d    %7.2f  %8.2f\n", axes[a], best1 * 1000.0, best2 * 1000.0);
+		sum1 += best1;
+		sum2 += best2;
+	}
+	printf("  mean  %7.2f  %8.2f\n", sum1 * 1000.0 / 6.0, sum2 * 1000.0 / 6.0);
+
+	free(src);
+	free(v1);
+	free(v2);
+	return ret;
+}
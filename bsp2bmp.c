@@ -26,18 +26,99 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <strings.h>
 #include <math.h>
+#include <float.h>
 #include <values.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <time.h>
+#include <zlib.h>
 
 #define PROGNAME  "bsp2bmp"
 #define V_MAJOR   0
 #define V_MINOR   0
-#define V_REV     15
-#define V_SUBREV  "d"
+#define V_REV     16
+#define V_SUBREV  ""
 
 #define Z_PAD_HACK    16
 #define MAX_REF_FACES 4
+#define MAX_NAME      1024
+#define MAX_PATTERNS  16
+#define MAX_COORD     1048576.0 /* furthest a vertex may be along any axis */
+#define MAX_LAYERS    32  /* -L, one bit each */
+#define DEPTH_BIAS    1.0 /* in map units, on top of a pixel's depth slope */
+#define MARKER_SIZE   4   /* entity markers, pixels from the centre */
+#define EDGE_BLOCK    1024 /* edges classified at a time, so the pass flags stay cached */
+#define NEAR_PLANE    4.0 /* perspective: nothing closer to the eye is drawn */
+#define DEFAULT_FOV   60.0 /* -C without -F */
+#define FLOOR_SLOPE   0.7 /* -G: faces this near level count as floors */
+#define FLOOR_LEVEL   96.0 /* -G: floor shading, under the edges drawn on top */
+
+#define DEG2RAD(a)    ((a) * 3.14159265358979 / 180.0)
+
+/* Colour modes */
+#define COLOR_GRAY    0   /* flat, as always */
+#define COLOR_NORMAL  1   /* by the facing of the edge's face */
+#define COLOR_HEIGHT  2   /* by Z along the camera axis */
+#define COLOR_MODEL   3   /* by model */
+#define COLOR_VIS     4   /* by how many of the -v viewpoints see it */
+#define COLOR_DIFF    5   /* by what changed since the -D map */
+
+/* Map diff (-D), what became of an edge */
+#define DIFF_SAME     0
+#define DIFF_ADDED    1
+#define DIFF_REMOVED  2
+#define DIFF_GRID     1.0 /* map units edge ends are rounded to, to match */
+
+/* Entity marker shapes */
+#define MARK_NONE     0
+#define MARK_SPAWN    1   /* X */
+#define MARK_ITEM     2   /* square */
+#define MARK_TELE     3   /* diamond */
+#define MARK_MONSTER  4   /* triangle */
+#define MIPTEX_NAME   16
+
+/* Stages timed for --stats */
+#define STAGE_LOAD       0
+#define STAGE_VALIDATE   1
+#define STAGE_PRECALC    2
+#define STAGE_TRANSFORM  3
+#define STAGE_RASTERIZE  4
+#define STAGE_POSTPROC   5
+#define STAGE_ENCODE     6
+#define NUM_STAGES       7
+
+#define STATS_NONE    0
+#define STATS_TEXT    1
+#define STATS_JSON    2
+
+/* -X: the usual surfaces nobody wants on a map */
+#define DEFAULT_TEX_EXCLUDE "sky*,*water*,*slime*,*lava*,trigger,clip"
+
+/* On-disk record sizes; don't trust sizeof() with a 64-bit long */
+#define BSP_HEADER_SIZE  124
+#define BSP_VERTEX_SIZE  12
+#define BSP_EDGE_SIZE    4
+#define BSP_LEDGE_SIZE   4
+#define BSP_FACE_SIZE    20
+#define BSP_MODEL_SIZE   64
+#define BSP_PLANE_SIZE   20
+#define BSP_TEXINFO_SIZE 40
+#define BSP_NODE_SIZE    24
+#define BSP_LEAF_SIZE    28
+#define BSP_MARK_SIZE    2
+
+/* Archive types */
+#define ARC_NONE      0
+#define ARC_PAK       1
+#define ARC_PK3       2
 
 #ifndef MAXINT
     #include <limits.h>
@@ -95,8 +176,8 @@ typedef struct vertex_t {
 
 /* edges */
 typedef struct edge_t {
-	unsigned short	vertex0; /* index of start vertex, 0..numvertices */
-	unsigned short	vertex1; /* index of   end vertex, 0..numvertices */
+	uint32_t	vertex0; /* index of start vertex, 0..numvertices */
+	uint32_t	vertex1; /* index of   end vertex, 0..numvertices */
 } edge_t;
 
 /* faces */
@@ -115,6 +196,69 @@ typedef struct face_t {
 	long		lightmap;
 } face_t;
 
+/* planes */
+typedef struct plane_t {
+	vertex_t	normal;
+	float		dist;
+	long		type;  /* 0-2 axial X/Y/Z, 3-5 closest to X/Y/Z */
+} plane_t;
+
+/* texture info */
+typedef struct texinfo_t {
+	vertex_t	vectorS;
+	float		distS;
+	vertex_t	vectorT;
+	float		distT;
+	long		texture_id;  /* index into the miptex lump */
+	long		animated;
+} texinfo_t;
+
+/* bsp nodes */
+typedef struct node_t {
+	long		plane_id;
+	short		front;  /* children: node, or -(leaf+1) if negative */
+	short		back;
+	short		bound_min[3];
+	short		bound_max[3];
+	unsigned short	face_id;
+	unsigned short	face_num;
+} node_t;
+
+/* bsp leaves */
+typedef struct leaf_t {
+	long		type;
+	long		vislist;  /* offset into the vis lump, -1 if none */
+	short		bound_min[3];
+	short		bound_max[3];
+	unsigned short	lface_id; /* into the face list (iface) lump */
+	unsigned short	lface_num;
+	unsigned char	sndwater;
+	unsigned char	sndsky;
+	unsigned char	sndslime;
+	unsigned char	sndlava;
+} leaf_t;
+
+/* An entity from the entities lump; classname points into the lump and
+   is not nul-terminated */
+typedef struct entity_t {
+	char		*classname;
+	long		 classname_len;
+	vertex_t	 origin;
+	int		 has_origin;
+	long		 model;  /* brush model ("*n"), or -1 */
+} entity_t;
+
+/* models (0 is the world, the rest are brush entities) */
+typedef struct model_t {
+	vertex_t	bound_min;
+	vertex_t	bound_max;
+	vertex_t	origin;
+	long		node_id[4];
+	long		numleafs;
+	long		face_id;
+	long		face_num;
+} model_t;
+
 /* MW */
 typedef struct edge_extra_t {
 	long		num_face_ref;
@@ -123,8 +267,86 @@ typedef struct edge_extra_t {
 	int		ref_faces_area[MAX_REF_FACES]; /* area of faces */
 } edge_extra_t;
 
+/* An edge that made it through the filters, on its way to the output */
+typedef struct segment_t {
+	long		v0, v1;  /* vertices */
+	unsigned int	color;
+	uint32_t	layers;  /* bit per -L layer it is drawn in */
+} segment_t;
+
+/* A vertex as the rasterizer wants it: whole pixels and the depth, worked
+   out once per vertex rather than for every edge that uses it */
+typedef struct spoint_t {
+	long		x, y;
+	float		z;
+} spoint_t;
+
+/* A floor to fill (-G), and how near the camera it is, for sorting */
+typedef struct floor_t {
+	float		z;
+	long		face;
+} floor_t;
+
+/* A free camera: world to camera space (X right, Y down the screen, Z
+   towards the eye, as for the axis cameras), and for perspective how far
+   the map's center is from the eye, where -s scales as it does for the
+   axis cameras */
+typedef struct camera_t {
+	float		m[16];   /* row major */
+	int		persp;
+	float		dist;
+	float		half;    /* half the field of view across, at dist */
+	float		radius;  /* of a sphere around the map */
+	vertex_t	center;
+} camera_t;
+
 typedef unsigned char eightbit;
 
+/* An edge as the map diff matches it: its ends on the DIFF_GRID, the
+   lower one first, so it doesn't matter which way round or what index it
+   has in either map */
+typedef struct edgekey_t {
+	int32_t		p[6];
+} edgekey_t;
+
+/* An open addressed (linear probing) hash set of edge keys */
+typedef struct edgeset_t {
+	struct edgekey_t *keys;
+	eightbit	*used;
+	unsigned long	 mask;   /* slots - 1, a power of two */
+} edgeset_t;
+
+/* A bsp file image in memory. Plain files and pak entries are mmap'd in
+   place, deflated pk3 entries are inflated into a buffer. */
+typedef struct bspdata_t {
+	char		 name[MAX_NAME];  /* file, or archive holding the bsp */
+	char		 entry[MAX_NAME]; /* bsp within the archive, or "" */
+	eightbit	*data;
+	long		 size;
+
+	eightbit	*map;     /* mapping to release when done, or NULL */
+	long		 mapsize;
+	eightbit	*buffer;  /* inflated data to free when done, or NULL */
+	eightbit	*stream;  /* read from stdin, to free when done, or NULL */
+} bspdata_t;
+
+/* An opened pak or pk3 file */
+typedef struct archive_t {
+	eightbit	*data;
+	long		 size;
+	int		 type;
+	long		 dirofs;  /* start of directory */
+	long		 dirend;  /* end of directory */
+} archive_t;
+
+typedef struct arcentry_t {
+	char		 name[MAX_NAME];
+	long		 offset;  /* of the (possibly compressed) data */
+	long		 size;    /* uncompressed size */
+	long		 csize;   /* compressed size */
+	int		 method;  /* 0 stored, 8 deflated */
+} arcentry_t;
+
 typedef struct options_t {
 	char	*bspf_name;
 	char	*outf_name;
@@ -137,6 +359,22 @@ typedef struct options_t {
 	int	 z_direction;
 	int	 camera_axis;
 	/* 1 - X, 2 - Y, 3 - Z, negatives come from negative side of axis */
+	int	 free_camera; /* -A, -F or -C: the camera below, not an axis */
+	float	 cam_angle[3]; /* yaw, pitch, roll in degrees */
+	float	 cam_fov;     /* perspective field of view in degrees, 0 for ortho */
+	int	 cam_has_pos;
+	vertex_t cam_pos;
+	int	 frames;      /* -T: a turntable of this many frames, 0 for one image */
+	float	 cam_orbit;   /* turntable: degrees the camera has gone round the map */
+
+	char	*diff_name;   /* -D: an older revision of the map to compare with */
+
+	char	*height_name; /* -H: a 16-bit PGM of the Z under each drawn pixel */
+	int	 height_min;  /* keep the lowest Z under a pixel, not the highest */
+
+	int	 layers;      /* -L: this many Z slices, an image each, 0 for one image */
+	int	 layer_has_z; /* the bounds below were given, not worked out */
+	float	 layer_z[MAX_LAYERS + 1];
 
 	int	 edgeremove;
 	float	 flat_threshold;
@@ -147,6 +385,36 @@ typedef struct options_t {
 
 	int	 write_raw;
 	int	 write_nocomp;
+	int	 write_svg;
+
+	float	 merge_tol;  /* pixels a joined line may stray from the edges */
+
+	int	 use_region;
+	float	 region[4];  /* x0,y0,x1,y1 in map units, across the camera axis */
+
+	int	 stats;      /* STATS_NONE, _TEXT or _JSON */
+	int	 progress;
+
+	char	*model_list; /* models to draw, NULL for all */
+	int	 plane_axes; /* 1 - X, 2 - Y, 4 - Z facing faces only, 0 for all */
+	int	 face_driven;
+
+	char	*tex_exclude[MAX_PATTERNS]; /* lists of texture name patterns */
+	int	 num_tex_exclude;
+
+	int	 hidden_lines;
+	int	 floor_plan;  /* -G: fill in the floors under the edges */
+
+	char	*viewpoint;  /* "x,y,z", an entity classname or @file, NULL for none */
+	int	 entity_overlay;
+
+	int	 color_mode;
+	int	 bitcount;   /* 8 grey, 24 RGB */
+
+	float	 gamma;
+	int	 level_lo;   /* input levels stretched to 0..255 */
+	int	 level_hi;
+	int	 thick_lines;
 } options_t;
 
 typedef struct bmp_infoheader_t {
@@ -171,6 +439,18 @@ typedef struct bmp_fileheader_t {
 	long		data_ofs;    /* 4     : 4 */
 } bmp_fileheader_t;
 
+/* What gets drawn into; 24-bit pixels are stored R, G, B */
+typedef struct canvas_t {
+	eightbit	*image;
+	long		 width;
+	long		 height;
+	int		 bpp;    /* bytes per pixel: 1 grey, 3 RGB */
+	uint16_t	*zmap;   /* -H: Z of what's drawn at each pixel, 0 for none, or NULL */
+	int		 zmap_min; /* keep the lowest Z, not the highest */
+	float		 zmap_lo;  /* Z that comes out as 1 */
+	float		 zmap_scale; /* Z to 1..65535 */
+} canvas_t;
+
 typedef struct rgb_quad_t {
 	eightbit	red;
 	eightbit	green;
@@ -178,6 +458,29 @@ typedef struct rgb_quad_t {
 	eightbit	unused;
 } rgb_quad_t;
 
+/* What one render took, for --stats */
+typedef struct stats_t {
+	double		 stage[NUM_STAGES];  /* seconds */
+	long		 edges;              /* looked at */
+	long		 culled_flat;        /* failed the flatness test */
+	long		 culled_area;        /* ... the area test */
+	long		 culled_length;      /* ... the length test */
+	long		 lines;              /* joined lines drawn */
+	long		 pixels;             /* pixels put down */
+	long		 saturated;          /* ... that hit 255 */
+	long		 bytes;              /* written out */
+	long		 width, height;
+} stats_t;
+
+struct stats_t	 stats;
+
+/* Set from a signal handler (or by whatever drives the render) to stop
+   the render in progress; polled between bands of work */
+volatile sig_atomic_t	 cancelled;
+
+/* If set, told now and then how far a stage has got */
+void	(*progress_hook)(char *stage, long done, long total);
+
 /*---------------------------------------------------------------------------*/
 
 void stdprintf( char *fmt, ... ) {
@@ -192,6 +495,105 @@ void stdprintf( char *fmt, ... ) {
 
 /*---------------------------------------------------------------------------*/
 
+/* Seconds on a clock that only goes forward */
+double timer(void) {
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void json_string(FILE *out, char *str) {
+	fputc('"', out);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+/* Print what the last render took, as text or one line of JSON */
+void report_stats(FILE *out, int mode, char *name, char *entry, char *outname) {
+	static char	*stage_names[NUM_STAGES] = {
+		"load", "validate", "precalc", "transform", "rasterize", "postprocess", "encode"
+	};
+	struct rusage	 ru;
+	double		 total=0.0;
+	long		 peak=0;
+	int		 i;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		peak = ru.ru_maxrss; /* kilobytes */
+	for (i=0; i<NUM_STAGES; i++)
+		total += stats.stage[i];
+
+	if (mode == STATS_JSON) {
+		fprintf(out, "{\"map\":");
+		json_string(out, name);
+		if (entry != NULL && entry[0] != '\0') {
+			fprintf(out, ",\"entry\":");
+			json_string(out, entry);
+		}
+		fprintf(out, ",\"output\":");
+		json_string(out, outname);
+		fprintf(out, ",\"width\":%ld,\"height\":%ld,\"seconds\":{", stats.width, stats.height);
+		for (i=0; i<NUM_STAGES; i++)
+			fprintf(out, "\"%s\":%.6f,", stage_names[i], stats.stage[i]);
+		fprintf(out, "\"total\":%.6f}", total);
+		fprintf(out, ",\"edges\":%ld,\"culled\":{\"flatness\":%ld,\"area\":%ld,\"length\":%ld}",
+		       stats.edges, stats.culled_flat, stats.culled_area, stats.culled_length);
+		fprintf(out, ",\"lines\":%ld,\"pixels\":%ld,\"saturated\":%ld,\"bytes\":%ld,\"peak_kb\":%ld}\n",
+		       stats.lines, stats.pixels, stats.saturated, stats.bytes, peak);
+	} else {
+		fprintf(out, "Stats for %s%s%s:\n", name, (entry != NULL && entry[0] != '\0') ? ":" : "", (entry != NULL) ? entry : "");
+		for (i=0; i<NUM_STAGES; i++)
+			fprintf(out, "  %-12s %10.3f ms\n", stage_names[i], stats.stage[i] * 1000.0);
+		fprintf(out, "  %-12s %10.3f ms\n", "total", total * 1000.0);
+		fprintf(out, "  edges %ld, culled by flatness %ld, area %ld, length %ld\n",
+		       stats.edges, stats.culled_flat, stats.culled_area, stats.culled_length);
+		fprintf(out, "  %ld lines, %ld pixels (%ld saturated) on %ldx%ld\n",
+		       stats.lines, stats.pixels, stats.saturated, stats.width, stats.height);
+		fprintf(out, "  %ld bytes written, peak memory %ld kB\n", stats.bytes, peak);
+	}
+	fflush(out);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void progress(char *stage, long done, long total) {
+	if (progress_hook != NULL)
+		progress_hook(stage, done, total);
+}
+
+/* --progress: a percentage on stderr */
+void show_progress(char *stage, long done, long total) {
+	static char	*last_stage = NULL;
+	static long	 last_pct = -1;
+	long		 pct;
+
+	pct = (total > 0) ? done * 100 / total : 100;
+	if (stage == last_stage && pct == last_pct)
+		return;
+	last_stage = stage;
+	last_pct = pct;
+	fprintf(stderr, "\r%-10s %3ld%%", stage, pct);
+	if (done >= total)
+		fprintf(stderr, "\n");
+}
+
+/* SIGINT/SIGTERM: finish up the current band and drop the render; a
+   second one kills as usual */
+void on_signal(int sig) {
+	cancelled = 1;
+	signal(sig, SIG_DFL);
+}
+
+/*---------------------------------------------------------------------------*/
+
 void show_help() {
 	stdprintf("BSP->bitmap, version %d.%d.%d%s\n",V_MAJOR,V_MINOR,V_REV,V_SUBREV);
 	stdprintf("Copyright (c) 1999-2004, Matthew Wong\n\n");
@@ -208,6 +610,14 @@ void show_help() {
 	stdprintf("                                        5  4  3\n");
 	stdprintf("                      default: 7\n");
 	stdprintf("    -c<camera_axis>   default: +Z (+/- X/Y/Z axis)\n");
+	stdprintf("    -A<yaw,pitch[,roll]>  free camera, in degrees: yaw 0 looks along +Y,\n");
+	stdprintf("                      90 along +X; pitch 90 looks straight down\n");
+	stdprintf("    -F<fov>           perspective with this field of view, in degrees\n");
+	stdprintf("                      (60 if only -C is given)\n");
+	stdprintf("    -C<x,y,z>         perspective from here, default: back far enough\n");
+	stdprintf("                      to see the whole map\n");
+	stdprintf("    -T<frames>        turntable: that many frames once round the map,\n");
+	stdprintf("                      written as a Y4M video (outfile - for stdout)\n");
 	stdprintf("    -t<flatness>      threshold of dot product for edge removal;\n");
 	stdprintf("                      default is 0.90\n");
 	stdprintf("    -e                disable extraneous edges removal\n");
@@ -217,42 +627,125 @@ void show_help() {
 	stdprintf("                      default is 0\n");
 	stdprintf("    -n                negative image (black on white\n");
 	stdprintf("    -r                write raw data, rather than bmp file\n");
+	stdprintf("    -S                write an SVG drawing, rather than bmp file\n");
 	stdprintf("    -q                quiet output\n");
+	stdprintf("    -m<models>        only draw these models, e.g. -m0 for the world only,\n");
+	stdprintf("                      -m0,3-5; default is all\n");
+	stdprintf("    -P<axes>          only draw faces facing along these axes,\n");
+	stdprintf("                      e.g. -Pz for floors/ceilings, -Pxy for walls\n");
+	stdprintf("    -f                face-driven: only draw edges used by a drawn face\n");
+	stdprintf("    -x<patterns>      skip faces with these textures, e.g. -xsky*,*water*\n");
+	stdprintf("    -X                skip sky, liquid, trigger and clip faces\n");
+	stdprintf("    -o                hidden line removal (edges behind faces aren't drawn)\n");
+	stdprintf("    -G                floor plan: fill in floors (and ramps) under the\n");
+	stdprintf("                      edges, shaded by height\n");
+	stdprintf("    -v<point>         only draw what is visible (PVS) from x,y,z or from\n");
+	stdprintf("                      the first entity of a class, e.g. -vinfo_player_start,\n");
+	stdprintf("                      or from any of a file of points, -v@points.txt\n");
+	stdprintf("    -E                mark spawns (X), items (square), teleporters (diamond)\n");
+	stdprintf("                      and monsters (triangle)\n");
+	stdprintf("    -R<x0,y0,x1,y1>   only draw this region of the map (map units)\n");
+	stdprintf("    -L<layers>        an image per Z slice: that many slices of the map,\n");
+	stdprintf("                      or between these Z bounds, e.g. -L3 or -L-64,128,512\n");
+	stdprintf("    -D<oldbsp>        show what changed since oldbsp: new edges green,\n");
+	stdprintf("                      removed ones red, the rest dim (see -b24)\n");
+	stdprintf("    -H<pgmfile>       also write the Z under each drawn pixel, as a 16-bit\n");
+	stdprintf("                      PGM (0 where nothing is drawn)\n");
+	stdprintf("    --height=min      -H keeps the lowest Z under a pixel, not the highest\n");
+	stdprintf("    --stats[=json]    report times and counts for each map\n");
+	stdprintf("    --progress        show how far drawing and writing have got\n");
+	stdprintf("    -k<mode>          color edges by: g - nothing (default), n - face facing,\n");
+	stdprintf("                      h - height along the camera axis, m - model,\n");
+	stdprintf("                      v - how many of the -v points see it\n");
+	stdprintf("    -b<bits>          8 (default, greyscale) or 24 (RGB) bit output\n");
+	stdprintf("    -g<gamma>         gamma correction of the final image, default: 1.0\n");
+	stdprintf("    -i<black,white>   stretch these levels to 0..255, e.g. -i0,96\n");
+	stdprintf("    -w                thicker (3 pixel wide) lines\n");
+	stdprintf("    -j<pixels>        let joined lines stray this far from the edges,\n");
+	stdprintf("                      default: 0 (only straight runs are joined)\n");
 	// stdprintf("    -u                write uncompressed bmp\n");
 	stdprintf("\n");
 	stdprintf("If [outfile] is omitted, then program will create .bmp file in the same directory as .bsp file.\n");
+	stdprintf("<bspfile> may also name a map inside a pak/pk3 archive, as in pak1.pak:maps/e1m1.bsp.\n");
+	stdprintf("If <bspfile> is an archive by itself, every map in it is rendered and [outfile]\n");
+	stdprintf("is taken as the output directory.\n");
+	stdprintf("A <bspfile> of - is read from stdin (-:maps/e1m1.bsp for an archive), an [outfile]\n");
+	stdprintf("of - is written to stdout; reading stdin writes to stdout unless told otherwise.\n");
 	return;
 }
 
 /*---------------------------------------------------------------------------*/
 
-void plotpoint(eightbit *image, long width, long height, long xco, long yco, unsigned int color) {
+/* Add color to a pixel: a grey level for 8-bit canvases, 0xRRGGBB for
+   24-bit ones, each channel saturating at 255 */
+void plotpoint(struct canvas_t *canvas, long xco, long yco, unsigned int color) {
 	unsigned int bigcol=0;
+	eightbit *pix;
+	int c, sat=0;
 
-	if(xco < 0 || xco > width || yco < 0 || yco > height)
+	if(xco < 0 || xco >= canvas->width || yco < 0 || yco >= canvas->height)
 		return;
 
-	bigcol=(unsigned int)image[yco * width + xco];
+	pix=&canvas->image[(yco * canvas->width + xco) * canvas->bpp];
+	stats.pixels++;
+	for (c=canvas->bpp-1; c>=0; c--) {
+		bigcol=(unsigned int)pix[c] + (color & 0xff);
 
-	bigcol=bigcol + color;
-
-	if (bigcol < 0)
-		bigcol=0;
-	if (bigcol > 255)
-		bigcol=255;
+		if (bigcol > 255) {
+			bigcol=255;
+			sat=1;
+		}
 
-	image[yco * width + xco]=(eightbit)bigcol;
+		pix[c]=(eightbit)bigcol;
+		color=color >> 8;
+	}
+	stats.saturated += sat;
 
 	return;
 }
 
 /*---------------------------------------------------------------------------*/
 
-void bresline(eightbit *image, long width, long height, long x1, long y1, long x2, long y2, unsigned int color) {
+/* Note z in the height map: whichever of it and what's there is the
+   higher (or lower, with --height=min) */
+void plotheight(struct canvas_t *canvas, long xco, long yco, float z) {
+	uint16_t *h, q;
+	float v;
+
+	if(xco < 0 || xco >= canvas->width || yco < 0 || yco >= canvas->height)
+		return;
+
+	v = (z - canvas->zmap_lo) * canvas->zmap_scale + 1.0;
+	if (v < 1.0)
+		v = 1.0;
+	if (v > 65535.0)
+		v = 65535.0;
+	q = (uint16_t)(v + 0.5);
+	h = &canvas->zmap[yco * canvas->width + xco];
+	if (*h == 0 || (canvas->zmap_min ? q < *h : q > *h))
+		*h = q;
+}
+
+/* Plot a point at depth z: with a depth buffer, only if it is at least as
+   near as what's there */
+void plotdepth(struct canvas_t *canvas, float *zbuf, long xco, long yco, float z, unsigned int color) {
+	if (zbuf != NULL && (xco < 0 || xco >= canvas->width || yco < 0 || yco >= canvas->height ||
+	                     z < zbuf[yco * canvas->width + xco]))
+		return;
+	plotpoint(canvas, xco, yco, color);
+	if (canvas->zmap != NULL)
+		plotheight(canvas, xco, yco, z);
+}
+
+/* Draw the pixels between two points, z1 at the start, z2 at the end.
+   The end points themselves are left to the caller, so that where lines
+   meet the pixel is only put down once. */
+void bresline(struct canvas_t *canvas, float *zbuf, long x1, long y1, float z1, long x2, long y2, float z2, unsigned int color) {
 	long x=0, y=0;
 	long deltax=0, deltay=0;
 	long xchange=0, ychange=0;
 	long error, length, i;
+	float z=z1, dz=0.0;
 
 	x=x1;
 	y=y1;
@@ -279,32 +772,668 @@ void bresline(eightbit *image, long width, long height, long x1, long y1, long x
 	i = 0;
 
 	if (deltax < deltay) {
-		length = deltay + 1;
+		length = deltay - 1;
+		if ((zbuf != NULL || canvas->zmap != NULL) && deltay > 0)
+			dz = (z2 - z1) / (float)deltay;
 		while (i < length) {
 			y = y + ychange;
 			error = error + deltax;
-			if (error > deltay) {
+			if (2 * error > deltay) {
 				x = x + xchange;
 				error = error - deltay;
 			}
 	        	i++;
+			z = z + dz;
 
-			plotpoint(image, width, height, x, y, color);
+			plotdepth(canvas, zbuf, x, y, z, color);
 		}
 	} else {
-		length = deltax + 1;
+		length = deltax - 1;
+		if ((zbuf != NULL || canvas->zmap != NULL) && deltax > 0)
+			dz = (z2 - z1) / (float)deltax;
 		while ( i < length) {
 			x = x + xchange;
 			error = error + deltay;
-			if (error > deltax) {
+			if (2 * error > deltax) {
 				y = y + ychange;
 				error = error - deltax;
 			}
 	        	i++;
+			z = z + dz;
+
+			plotdepth(canvas, zbuf, x, y, z, color);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Clip the line (x0,y0,z0)-(x1,y1,z1) to the box xmin..xmax, ymin..ymax,
+   moving its ends in place. Returns 0 if nothing of it is left. */
+int clip_line(float *x0, float *y0, float *z0, float *x1, float *y1, float *z1,
+              float xmin, float ymin, float xmax, float ymax) {
+	float	p[4], q[4], t0=0.0, t1=1.0, t, dx, dy, dz;
+	int	i;
+
+	dx = *x1 - *x0;
+	dy = *y1 - *y0;
+	dz = *z1 - *z0;
+	p[0] = -dx; q[0] = *x0 - xmin;
+	p[1] =  dx; q[1] = xmax - *x0;
+	p[2] = -dy; q[2] = *y0 - ymin;
+	p[3] =  dy; q[3] = ymax - *y0;
+
+	for (i=0; i<4; i++) {
+		if (p[i] == 0.0) {
+			if (q[i] < 0.0)
+				return 0;
+			continue;
+		}
+		t = q[i] / p[i];
+		if (p[i] < 0.0) {
+			if (t > t1)
+				return 0;
+			if (t > t0)
+				t0 = t;
+		} else {
+			if (t < t0)
+				return 0;
+			if (t < t1)
+				t1 = t;
+		}
+	}
+
+	*x1 = *x0 + t1 * dx;
+	*y1 = *y0 + t1 * dy;
+	*z1 = *z0 + t1 * dz;
+	*x0 = *x0 + t0 * dx;
+	*y0 = *y0 + t0 * dy;
+	*z0 = *z0 + t0 * dz;
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Fill a convex polygon (screen x/y, camera z) into the depth buffer,
+   keeping the nearest (largest) z. The face is pushed back by a pixel's
+   worth of its depth slope so its own edges still pass the depth test. */
+void depthface(float *zbuf, long width, long height, float *px, float *py, float *pz, long num) {
+	long	 t, e, x, y, xmin, xmax, ymin, ymax, xl, xr;
+	float	 tx[3], ty[3], tz[3];
+	float	 area, sign, dzdx, dzdy, bias, cy, ea, ec, bound, z;
+	float	*row;
+
+	/* fan of triangles */
+	for (t=1; t<num-1; t++) {
+		tx[0] = px[0];   ty[0] = py[0];   tz[0] = pz[0];
+		tx[1] = px[t];   ty[1] = py[t];   tz[1] = pz[t];
+		tx[2] = px[t+1]; ty[2] = py[t+1]; tz[2] = pz[t+1];
+
+		area = (tx[1]-tx[0])*(ty[2]-ty[0]) - (tx[2]-tx[0])*(ty[1]-ty[0]);
+		if (fabs(area) < 1e-6)
+			continue;
+		sign = (area > 0.0) ? 1.0 : -1.0;
+
+		/* z = tz[0] + dzdx*(x-tx[0]) + dzdy*(y-ty[0]) */
+		dzdx = ((tz[1]-tz[0])*(ty[2]-ty[0]) - (tz[2]-tz[0])*(ty[1]-ty[0])) / area;
+		dzdy = ((tx[1]-tx[0])*(tz[2]-tz[0]) - (tx[2]-tx[0])*(tz[1]-tz[0])) / area;
+		bias = fabs(dzdx) + fabs(dzdy) + DEPTH_BIAS;
+
+		ymin = (long)floor(fmin(ty[0], fmin(ty[1], ty[2])));
+		ymax = (long)ceil(fmax(ty[0], fmax(ty[1], ty[2])));
+		xmin = (long)floor(fmin(tx[0], fmin(tx[1], tx[2])));
+		xmax = (long)ceil(fmax(tx[0], fmax(tx[1], tx[2])));
+		if (ymin < 0)
+			ymin = 0;
+		if (ymax > height - 1)
+			ymax = height - 1;
+		if (xmin < 0)
+			xmin = 0;
+		if (xmax > width - 1)
+			xmax = width - 1;
+
+		for (y=ymin; y<=ymax; y++) {
+			/* clip the row's span against each edge, sampling pixel centres */
+			cy = (float)y + 0.5;
+			xl = xmin;
+			xr = xmax;
+			for (e=0; e<3 && xl<=xr; e++) {
+				/* inside where sign * ((xb-xa)*(cy-ya) - (yb-ya)*(cx-xa)) >= 0 */
+				ea = -sign * (ty[(e+1)%3] - ty[e]);
+				ec =  sign * ((tx[(e+1)%3] - tx[e])*(cy - ty[e]) + (ty[(e+1)%3] - ty[e])*tx[e]);
+				if (ea == 0.0) {
+					if (ec < 0.0)
+						xr = xl - 1;
+					continue;
+				}
+				bound = -ec/ea - 0.5;
+				if (ea > 0.0) {
+					x = (long)ceil(bound);
+					if (x > xl)
+						xl = x;
+				} else {
+					x = (long)floor(bound);
+					if (x < xr)
+						xr = x;
+				}
+			}
+
+			row = &zbuf[y * width];
+			z = tz[0] + dzdx*((float)xl + 0.5 - tx[0]) + dzdy*(cy - ty[0]) - bias;
+			for (x=xl; x<=xr; x++) {
+				if (z > row[x])
+					row[x] = z;
+				z = z + dzdx;
+			}
+		}
+	}
+
+	return;
+}
+
+/* Set pixels x0..x1 of row y to one color. Grey rows are a memset, RGB
+   ones get the first pixel copied along in doubling runs, so either way
+   the library's wide stores do the work. */
+void fill_span(struct canvas_t *canvas, long y, long x0, long x1, unsigned int color) {
+	eightbit	*row = &canvas->image[(y * canvas->width + x0) * canvas->bpp];
+	long		 n = (x1 - x0 + 1) * canvas->bpp, k;
+
+	if (canvas->bpp == 1) {
+		memset(row, (int)color, n);
+		return;
+	}
+	row[0] = (eightbit)(color >> 16);
+	row[1] = (eightbit)(color >> 8);
+	row[2] = (eightbit)color;
+	for (k=3; k<n; k*=2)
+		memcpy(&row[k], row, (k < n - k) ? k : n - k);
+}
+
+/* Fill a convex polygon (screen x/y) with one color, a row at a time:
+   each row's span runs between where it crosses the polygon's sides,
+   sampling pixel centres as depthface does */
+void fillface(struct canvas_t *canvas, float *px, float *py, long num, unsigned int color) {
+	long	 e, f, y, ymin, ymax, xl, xr;
+	float	 cy, xa, xb, t;
+
+	ymin = ymax = 0;
+	for (e=1; e<num; e++) {
+		if (py[e] < py[ymin])
+			ymin = e;
+		if (py[e] > py[ymax])
+			ymax = e;
+	}
+	/* (clamped before they become whole pixels, the face may reach far
+	   off the image) */
+	ymin = (long)ceil(fmax(py[ymin], 0.0) - 0.5);
+	ymax = (long)floor(fmin(py[ymax], (float)canvas->height) - 0.5);
+
+	for (y=ymin; y<=ymax; y++) {
+		cy = (float)y + 0.5;
+		xa = FLT_MAX;
+		xb = -FLT_MAX;
+		for (e=0; e<num; e++) {
+			/* sides crossing the row, their top end in, the bottom out */
+			f = (e + 1) % num;
+			if ((py[e] <= cy && cy < py[f]) || (py[f] <= cy && cy < py[e])) {
+				t = px[e] + (px[f] - px[e]) * (cy - py[e]) / (py[f] - py[e]);
+				xa = fmin(xa, t);
+				xb = fmax(xb, t);
+			}
+		}
+		if (xa > xb)
+			continue;
+		xl = (long)ceil(fmax(xa, 0.0) - 0.5);
+		xr = (long)floor(fmin(xb, (float)canvas->width) - 0.5);
+		if (xl <= xr)
+			fill_span(canvas, y, xl, xr, color);
+	}
+}
+
+/* qsort: far floors first */
+int floor_cmp(const void *a, const void *b) {
+	float	za = ((struct floor_t *)a)->z, zb = ((struct floor_t *)b)->z;
+
+	return (za < zb) ? -1 : (za > zb) ? 1 : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* An edge color from r, g, b in 0..1 at a given intensity: 0xRRGGBB for
+   24-bit canvases, its luminance for 8-bit ones */
+unsigned int make_color(struct canvas_t *canvas, float r, float g, float b, float level) {
+	if (canvas->bpp == 1)
+		return (unsigned int)(level * (0.299*r + 0.587*g + 0.114*b));
+
+	return ((unsigned int)(level * r) << 16) | ((unsigned int)(level * g) << 8) | (unsigned int)(level * b);
+}
+
+/* Blue - cyan - green - yellow - red ramp over v in 0..1 (a grey ramp on
+   8-bit canvases, where luminance would jump about) */
+unsigned int ramp_color(struct canvas_t *canvas, float v, float level) {
+	float	r, g, b;
+
+	if (v < 0.0)
+		v = 0.0;
+	if (v > 1.0)
+		v = 1.0;
+
+	if (canvas->bpp == 1)
+		return (unsigned int)(level * (0.25 + 0.75 * v));
+
+	if (v < 0.25) {
+		r = 0.0; g = v * 4.0; b = 1.0;
+	} else if (v < 0.5) {
+		r = 0.0; g = 1.0; b = 1.0 - (v - 0.25) * 4.0;
+	} else if (v < 0.75) {
+		r = (v - 0.5) * 4.0; g = 1.0; b = 0.0;
+	} else {
+		r = 1.0; g = 1.0 - (v - 0.75) * 4.0; b = 0.0;
+	}
+
+	return make_color(canvas, r, g, b, level);
+}
+
+/* Diff colors: unchanged edges dim, added ones green, removed ones red
+   (on 8-bit canvases, bright and middling grey) */
+unsigned int diff_color(struct canvas_t *canvas, int what, float level) {
+	switch (what) {
+		case DIFF_ADDED:
+			return (canvas->bpp == 1) ? (unsigned int)level : make_color(canvas, 0.0, 1.0, 0.0, level);
+		case DIFF_REMOVED:
+			return (canvas->bpp == 1) ? (unsigned int)(level * 2.0 / 3.0) : make_color(canvas, 1.0, 0.0, 0.0, level);
+		default:
+			return make_color(canvas, 1.0, 1.0, 1.0, level / 3.0);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Levels, gamma and negation folded into one lookup table */
+void make_lut(eightbit *lut, struct options_t *opt) {
+	int	i;
+	float	v;
+
+	for (i=0; i<256; i++) {
+		v = (float)(i - opt->level_lo) / (float)(opt->level_hi - opt->level_lo);
+		if (v < 0.0)
+			v = 0.0;
+		if (v > 1.0)
+			v = 1.0;
+		if (opt->gamma != 1.0)
+			v = pow(v, 1.0 / opt->gamma);
+		lut[i] = (eightbit)(v * 255.0 + 0.5);
+		if (opt->negative_image)
+			lut[i] = 255 - lut[i];
+	}
+}
+
+/* Post-process row y of the canvas into out, ready to be written: an
+   optional 3x3 dilate (max of each channel over the neighbours), then
+   the lookup table. tmp holds a row; bgr swaps 24-bit pixels for BMP */
+void finish_row(struct canvas_t *canvas, long y, eightbit *lut, int thick, int bgr, eightbit *tmp, eightbit *out) {
+	long		 n = canvas->width * canvas->bpp, b = canvas->bpp, i;
+	eightbit	*src = &canvas->image[y * n];
+	eightbit	*up, *down;
+	eightbit	 t;
+
+	if (thick) {
+		up = (y > 0) ? src - n : src;
+		down = (y < canvas->height - 1) ? src + n : src;
+
+		/* vertical max first, then across; plain loops the compiler
+		   can vectorise */
+		for (i=0; i<n; i++) {
+			t = (up[i] > src[i]) ? up[i] : src[i];
+			tmp[i] = (down[i] > t) ? down[i] : t;
+		}
+		for (i=0; i<n; i++) {
+			t = tmp[i];
+			if (i >= b && tmp[i-b] > t)
+				t = tmp[i-b];
+			if (i + b < n && tmp[i+b] > t)
+				t = tmp[i+b];
+			out[i] = t;
+		}
+		src = out;
+	}
+
+	if (bgr && b == 3) {
+		for (i=0; i<n; i+=3) {
+			t = src[i];
+			out[i]   = lut[src[i+2]];
+			out[i+1] = lut[src[i+1]];
+			out[i+2] = lut[t];
+		}
+	} else {
+		for (i=0; i<n; i++)
+			out[i] = lut[src[i]];
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Move a point (or direction) into camera space: X right, Y down the
+   screen, Z out of the screen towards the camera */
+void to_camera(struct vertex_t *v, int camera_axis) {
+	float	tempf;
+
+	/* Ugly hack - flip stuff around for different camera angles */
+	switch(camera_axis) {
+		case -1:
+			/* -X -- (-y <-->  +y, +x into screen, -x out of screen; -z down, +z up) */
+			tempf = v->X;
+			v->X = v->Y;
+			v->Y = v->Z;
+			v->Z = -tempf;
+			break;
+		case 1:
+			/* +X -- (+y <--> -y; -x into screen, +x out of screen; -z down, +z up) */
+			tempf = v->X;
+			v->X = -v->Y;
+			v->Y =  v->Z;
+			v->Z =  tempf;
+			break;
+		case -2:
+			/* -Y -- (+x <--> -x; -y out of screen, +z up) */
+			v->X = -v->X;
+			tempf = v->Z;
+			v->Z = v->Y;
+			v->Y =  tempf;
+			break;
+		case 2:
+			/* +Y -- (-x <--> +x; +y out of screen, +z up) */
+			tempf = v->Z;
+			v->Z = -v->Y;
+			v->Y =  tempf;
+			break;
+		case -3:
+			/* -Z -- negate X and Z (ie. 180 rotate along Y axis) */
+			v->X = -v->X;
+			v->Z = -v->Z;
+			break;
+		case 3:	/* +Z -- do nothing! */
+		default:/* do nothing! */
+			break;
+	} /* switch */
+	
+	/* flip Y for proper screen cords */
+	v->Y = -v->Y;
+
+	return;
+}
+
+/* to_camera() for a whole list at once, also finding its bounds. There is
+   one of these per camera axis, made by CAMERA_KERNEL from the moves
+   to_camera() does (Y flip included), so the axis is picked once per
+   render and not once per vertex. */
+#define CAMERA_KERNEL(name, NX, NY, NZ) \
+void name(struct vertex_t *v, long num, struct vertex_t *lo, struct vertex_t *hi) { \
+	long	i; \
+	float	x, y, z, cx, cy, cz; \
+	float	x0 = HUGE_VAL, x1 = -HUGE_VAL, y0 = HUGE_VAL, y1 = -HUGE_VAL, z0 = HUGE_VAL, z1 = -HUGE_VAL; \
+ \
+	for (i=0; i<num; i++) { \
+		x = v[i].X; \
+		y = v[i].Y; \
+		z = v[i].Z; \
+		cx = NX; \
+		cy = NY; \
+		cz = NZ; \
+		v[i].X = cx; \
+		v[i].Y = cy; \
+		v[i].Z = cz; \
+		x0 = (cx < x0) ? cx : x0;  x1 = (cx > x1) ? cx : x1; \
+		y0 = (cy < y0) ? cy : y0;  y1 = (cy > y1) ? cy : y1; \
+		z0 = (cz < z0) ? cz : z0;  z1 = (cz > z1) ? cz : z1; \
+	} \
+	if (num == 0) \
+		x0 = x1 = y0 = y1 = z0 = z1 = 0.0; \
+	lo->X = x0;  lo->Y = y0;  lo->Z = z0; \
+	hi->X = x1;  hi->Y = y1;  hi->Z = z1; \
+}
+
+CAMERA_KERNEL(camera_nx,  y, -z, -x)
+CAMERA_KERNEL(camera_px, -y, -z,  x)
+CAMERA_KERNEL(camera_ny, -x, -z,  y)
+CAMERA_KERNEL(camera_py,  x, -z, -y)
+CAMERA_KERNEL(camera_nz, -x, -y, -z)
+CAMERA_KERNEL(camera_pz,  x, -y,  z)
+
+void camera_list(struct vertex_t *v, long num, int camera_axis, struct vertex_t *lo, struct vertex_t *hi) {
+	switch(camera_axis) {
+		case -1: camera_nx(v, num, lo, hi); break;
+		case  1: camera_px(v, num, lo, hi); break;
+		case -2: camera_ny(v, num, lo, hi); break;
+		case  2: camera_py(v, num, lo, hi); break;
+		case -3: camera_nz(v, num, lo, hi); break;
+		case  3:
+		default: camera_pz(v, num, lo, hi); break;
+	}
+}
+
+/* Set up the free camera for a map: the view matrix from the -A angles,
+   and for perspective the eye, either -C or backed off from the middle
+   of the map until all of it is in view */
+void make_camera(struct camera_t *cam, struct options_t *opt, struct vertex_t *list, long num) {
+	struct vertex_t	lo, hi, f, r, u, t, eye;
+	double		yaw, pitch, roll, radius;
+	long		i;
+
+	lo.X = lo.Y = lo.Z = 0.0;
+	hi = lo;
+	if (num > 0)
+		lo = hi = list[0];
+	for (i=1; i<num; i++) {
+		lo.X = fmin(lo.X, list[i].X);  hi.X = fmax(hi.X, list[i].X);
+		lo.Y = fmin(lo.Y, list[i].Y);  hi.Y = fmax(hi.Y, list[i].Y);
+		lo.Z = fmin(lo.Z, list[i].Z);  hi.Z = fmax(hi.Z, list[i].Z);
+	}
+	cam->center.X = (lo.X + hi.X) / 2.0;
+	cam->center.Y = (lo.Y + hi.Y) / 2.0;
+	cam->center.Z = (lo.Z + hi.Z) / 2.0;
+	radius = sqrt((hi.X - lo.X) * (hi.X - lo.X) + (hi.Y - lo.Y) * (hi.Y - lo.Y) + (hi.Z - lo.Z) * (hi.Z - lo.Z)) / 2.0;
+	if (radius < 1.0)
+		radius = 1.0;
+	cam->radius = radius;
+
+	/* forward, right and up; yaw 0 pitch 0 looks along +Y with +Z up */
+	yaw = DEG2RAD(opt->cam_angle[0] + opt->cam_orbit);
+	pitch = DEG2RAD(opt->cam_angle[1]);
+	roll = DEG2RAD(opt->cam_angle[2]);
+	f.X = cos(pitch) * sin(yaw);
+	f.Y = cos(pitch) * cos(yaw);
+	f.Z = -sin(pitch);
+	r.X = cos(yaw);
+	r.Y = -sin(yaw);
+	r.Z = 0.0;
+	u.X = r.Y * f.Z - r.Z * f.Y;
+	u.Y = r.Z * f.X - r.X * f.Z;
+	u.Z = r.X * f.Y - r.Y * f.X;
+	t = r;
+	r.X = t.X * cos(roll) + u.X * sin(roll);
+	r.Y = t.Y * cos(roll) + u.Y * sin(roll);
+	r.Z = t.Z * cos(roll) + u.Z * sin(roll);
+	u.X = u.X * cos(roll) - t.X * sin(roll);
+	u.Y = u.Y * cos(roll) - t.Y * sin(roll);
+	u.Z = u.Z * cos(roll) - t.Z * sin(roll);
+
+	cam->persp = (opt->cam_fov > 0.0);
+	if (opt->cam_has_pos) {
+		/* going round the map's middle, for a turntable */
+		t.X = opt->cam_pos.X - cam->center.X;
+		t.Y = opt->cam_pos.Y - cam->center.Y;
+		eye.X = cam->center.X + t.X * cos(DEG2RAD(opt->cam_orbit)) + t.Y * sin(DEG2RAD(opt->cam_orbit));
+		eye.Y = cam->center.Y - t.X * sin(DEG2RAD(opt->cam_orbit)) + t.Y * cos(DEG2RAD(opt->cam_orbit));
+		eye.Z = opt->cam_pos.Z;
+	} else if (cam->persp) {
+		t.X = radius / sin(DEG2RAD(opt->cam_fov) / 2.0);
+		eye.X = cam->center.X - f.X * t.X;
+		eye.Y = cam->center.Y - f.Y * t.X;
+		eye.Z = cam->center.Z - f.Z * t.X;
+	} else {
+		eye = cam->center;
+	}
+	cam->dist = f.X * (cam->center.X - eye.X) + f.Y * (cam->center.Y - eye.Y) + f.Z * (cam->center.Z - eye.Z);
+	if (cam->dist < radius / 4.0)
+		cam->dist = radius / 4.0;  /* the eye is in the map, or past its middle */
+	cam->half = cam->persp ? cam->dist * tan(DEG2RAD(opt->cam_fov) / 2.0) : 0.0;
+
+	/* X right, Y down, Z towards the eye */
+	cam->m[0] = r.X;   cam->m[1] = r.Y;   cam->m[2] = r.Z;   cam->m[3] = -(r.X * eye.X + r.Y * eye.Y + r.Z * eye.Z);
+	cam->m[4] = -u.X;  cam->m[5] = -u.Y;  cam->m[6] = -u.Z;  cam->m[7] = u.X * eye.X + u.Y * eye.Y + u.Z * eye.Z;
+	cam->m[8] = -f.X;  cam->m[9] = -f.Y;  cam->m[10] = -f.Z; cam->m[11] = f.X * eye.X + f.Y * eye.Y + f.Z * eye.Z;
+	cam->m[12] = 0.0;  cam->m[13] = 0.0;  cam->m[14] = 0.0;  cam->m[15] = 1.0;
+}
+
+/* The free camera's matrix over a whole vertex list, into camera space */
+void camera_view(struct camera_t *cam, struct vertex_t *v, long num) {
+	/* the matrix in locals: read through cam, a store to v[] might have
+	   changed it, and the loop could not be vectorized */
+	float	 m0 = cam->m[0], m1 = cam->m[1], m2 = cam->m[2],  m3 = cam->m[3];
+	float	 m4 = cam->m[4], m5 = cam->m[5], m6 = cam->m[6],  m7 = cam->m[7];
+	float	 m8 = cam->m[8], m9 = cam->m[9], m10 = cam->m[10], m11 = cam->m[11];
+	float	 x, y, z;
+	long	 i;
+
+	for (i=0; i<num; i++) {
+		x = v[i].X;
+		y = v[i].Y;
+		z = v[i].Z;
+		v[i].X = m0 * x + m1 * y + m2 * z + m3;
+		v[i].Y = m4 * x + m5 * y + m6 * z + m7;
+		v[i].Z = m8 * x + m9 * y + m10 * z + m11;
+	}
+}
+
+/* Divide by the distance for perspective, so the map's center keeps the
+   scale it would have orthographic. Z becomes dist * (dist/d - 1): still
+   bigger nearer the eye, about map units around the center, and unlike d
+   itself it goes linearly across the screen, as the depth buffer wants.
+   Vertices behind the near plane get a 1 in flag and are left out of the
+   bounds, which perspective also keeps inside the field of view. */
+void camera_project(struct camera_t *cam, struct vertex_t *v, long num, char *flag, struct vertex_t *lo, struct vertex_t *hi) {
+	float	 d, k;
+	long	 i, n = 0;
+
+	lo->X = lo->Y = lo->Z = 0.0;
+	*hi = *lo;
+	for (i=0; i<num; i++) {
+		if (cam->persp) {
+			d = -v[i].Z;
+			if (d < NEAR_PLANE) {
+				flag[i] = 1;
+				continue;
+			}
+			k = cam->dist / d;
+			v[i].X *= k;
+			v[i].Y *= k;
+			v[i].Z = cam->dist * (k - 1.0);
+		}
+		if (n++ == 0) {
+			*lo = *hi = v[i];
+			continue;
+		}
+		lo->X = fmin(lo->X, v[i].X);  hi->X = fmax(hi->X, v[i].X);
+		lo->Y = fmin(lo->Y, v[i].Y);  hi->Y = fmax(hi->Y, v[i].Y);
+		lo->Z = fmin(lo->Z, v[i].Z);  hi->Z = fmax(hi->Z, v[i].Z);
+	}
+	if (cam->persp) {
+		lo->X = fmax(lo->X, -cam->half);  hi->X = fmin(hi->X, cam->half);
+		lo->Y = fmax(lo->Y, -cam->half);  hi->Y = fmin(hi->Y, cam->half);
+		/* all of the map off to one side: an empty picture, not a
+		   negative one */
+		lo->X = fmin(lo->X, hi->X);
+		lo->Y = fmin(lo->Y, hi->Y);
+	}
+}
+
+/* A single point through the free camera; 0 if it is behind the eye */
+int camera_point(struct camera_t *cam, struct vertex_t *v) {
+	struct vertex_t	lo, hi;
+	char		flag = 0;
 
-			plotpoint(image, width, height, x, y, color);
+	camera_view(cam, v, 1);
+	camera_project(cam, v, 1, &flag, &lo, &hi);
+	return !flag;
+}
+
+/* A direction (a face normal) through the free camera, no moving */
+void camera_dir(struct camera_t *cam, struct vertex_t *v) {
+	float	*m = cam->m;
+	float	 x = v->X, y = v->Y, z = v->Z;
+
+	v->X = m[0] * x + m[1] * y + m[2] * z;
+	v->Y = m[4] * x + m[5] * y + m[6] * z;
+	v->Z = m[8] * x + m[9] * y + m[10] * z;
+}
+
+/* Cut the listed edges that cross the near plane where they cross it,
+   each getting a new vertex there (flag 2); edges wholly behind it are
+   taken off the list. Vertices are in camera space, not yet divided.
+   *list may be NULL for all edges, and is then made. The vertex list and
+   flags grow to fit; returns the new number of vertices, -1 if out of
+   memory. */
+long near_clip(struct vertex_t **vlist, long numverts, char **flag, struct edge_t *edges, long numedges, long **list, long *num) {
+	struct vertex_t	*v = *vlist, *nv, *a, *b;
+	char		*nf;
+	long		 i, n, k, cut = 0, numkeep = 0;
+	int		 b0, b1;
+	float		 t;
+
+	if (*list == NULL) {
+		if ((*list = malloc(sizeof(long) * (numedges + 1))) == NULL)
+			return -1;
+		for (n=0; n<numedges; n++)
+			(*list)[n] = n;
+		*num = numedges;
+	}
+
+	for (n=0; n<*num; n++) {
+		i = (*list)[n];
+		b0 = -v[edges[i].vertex0].Z < NEAR_PLANE;
+		b1 = -v[edges[i].vertex1].Z < NEAR_PLANE;
+		if (b0 != b1)
+			cut++;
+	}
+	if (cut > 0) {
+		nv = realloc(v, sizeof(struct vertex_t) * (numverts + cut + 1));
+		if (nv == NULL)
+			return -1;
+		*vlist = v = nv;
+		nf = realloc(*flag, numverts + cut + 1);
+		if (nf == NULL)
+			return -1;
+		*flag = nf;
+		memset(&nf[numverts], 2, cut + 1);
+	}
+
+	k = numverts;
+	for (n=0; n<*num; n++) {
+		i = (*list)[n];
+		b0 = -v[edges[i].vertex0].Z < NEAR_PLANE;
+		b1 = -v[edges[i].vertex1].Z < NEAR_PLANE;
+		if (b0 && b1)
+			continue;
+		if (b0 != b1) {
+			/* where it meets the near plane, going from the end in
+			   front (a) to the one behind (b) */
+			a = b0 ? &v[edges[i].vertex1] : &v[edges[i].vertex0];
+			b = b0 ? &v[edges[i].vertex0] : &v[edges[i].vertex1];
+			t = (-a->Z - NEAR_PLANE) / (b->Z - a->Z);
+			v[k].X = a->X + t * (b->X - a->X);
+			v[k].Y = a->Y + t * (b->Y - a->Y);
+			v[k].Z = -NEAR_PLANE;
+			if (b0)
+				edges[i].vertex0 = (uint32_t)k;
+			else
+				edges[i].vertex1 = (uint32_t)k;
+			k++;
 		}
+		(*list)[numkeep++] = i;
 	}
+	*num = numkeep;
+	return k;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -321,6 +1450,22 @@ void def_options(struct options_t *opt) {
 
 	locopt.z_direction = 1;
 	locopt.camera_axis = 3; /* default is from +Z */
+	locopt.free_camera = 0;
+	locopt.cam_angle[0] = 0.0;
+	locopt.cam_angle[1] = 90.0; /* straight down, like +Z */
+	locopt.cam_angle[2] = 0.0;
+	locopt.cam_fov = 0.0;
+	locopt.cam_has_pos = 0;
+	locopt.frames = 0;
+	locopt.cam_orbit = 0.0;
+
+	locopt.diff_name = NULL;
+
+	locopt.height_name = NULL;
+	locopt.height_min = 0;
+
+	locopt.layers = 0;
+	locopt.layer_has_z = 0;
 
 	locopt.edgeremove = 1;
 	locopt.flat_threshold = 0.90;
@@ -331,6 +1476,34 @@ void def_options(struct options_t *opt) {
 
 	locopt.write_raw = 0;
 	locopt.write_nocomp = 1;
+	locopt.write_svg = 0;
+
+	locopt.merge_tol = 0.0;
+
+	locopt.use_region = 0;
+
+	locopt.stats = STATS_NONE;
+	locopt.progress = 0;
+
+	locopt.model_list = NULL;
+	locopt.plane_axes = 0;
+	locopt.face_driven = 0;
+
+	locopt.num_tex_exclude = 0;
+
+	locopt.hidden_lines = 0;
+	locopt.floor_plan = 0;
+
+	locopt.viewpoint = NULL;
+	locopt.entity_overlay = 0;
+
+	locopt.color_mode = COLOR_GRAY;
+	locopt.bitcount = 8;
+
+	locopt.gamma = 1.0;
+	locopt.level_lo = 0;
+	locopt.level_hi = 255;
+	locopt.thick_lines = 0;
 
 	memcpy(opt, &locopt, sizeof(struct options_t));
 	return;
@@ -340,9 +1513,9 @@ void def_options(struct options_t *opt) {
 
 void get_options(struct options_t *opt, int argc, char *argv[]) {
 	static struct options_t	 locopt;
-	int			 i=0;
+	int			 i=0, j=0, k=0, pos=0, len=0;
 	char			*arg;
-	long			 lnum=0;
+	long			 lnum=0, lnum2=0;
 	float			 fnum=0.0;
 	char			 pm='+', axis='Z';
 
@@ -354,17 +1527,35 @@ void get_options(struct options_t *opt, int argc, char *argv[]) {
 	/* Go through command line */
 	for (i=1; i<argc; i++) {
 		arg=argv[i];
-		if(arg[0] == '-') {
+		if(arg[0] == '-' && arg[1] != '\0' && arg[1] != ':') {
 			/* Okay, dash-something */
 			switch(arg[1]) {
+				case '-':
+					if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats=text") == 0) {
+						locopt.stats = STATS_TEXT;
+					} else if (strcmp(arg, "--stats=json") == 0) {
+						locopt.stats = STATS_JSON;
+					} else if (strcmp(arg, "--progress") == 0) {
+						locopt.progress = 1;
+					} else if (strcmp(arg, "--height=max") == 0) {
+						locopt.height_min = 0;
+					} else if (strcmp(arg, "--height=min") == 0) {
+						locopt.height_min = 1;
+					} else {
+						stdprintf("Unknown option %s.\n", arg);
+						show_help();
+						exit(1);
+					}
+					break;
+
 				case 'q':
 					quiet = 1;
 					break;
 				
 				case 's':
-					if(sscanf(&arg[2],"%ld",&lnum) == 1)
-						if (lnum > 0)
-							locopt.scaledown = (float)lnum;
+					if(sscanf(&arg[2],"%f",&fnum) == 1)
+						if (fnum > 0.0)
+							locopt.scaledown = fnum;
 					break;
 
 				case 'z':
@@ -464,131 +1655,2119 @@ void get_options(struct options_t *opt, int argc, char *argv[]) {
 				case 'u':
 					locopt.write_nocomp = 1;
 					break;
-				
-				default:
-					stdprintf("Unknown option: -%s\n",&arg[1]);
-					show_help();
-					exit (1);
+
+				case 'S':
+					locopt.write_svg = 1;
 					break;
-			} /* switch */
-		} else {
-			if(locopt.bspf_name == NULL) {
-				locopt.bspf_name = arg;
-			} else if (locopt.outf_name == NULL) {
-				locopt.outf_name = arg;
-			} else {
-				stdprintf("Unknown option: %s\n",arg);
-				show_help();
-				exit(1);
-			}
-		} /* if */
-	} /* for */
 
-	memcpy(opt, &locopt, sizeof(struct options_t));
-	return;
-}
+				case 'j':
+					if(sscanf(&arg[2],"%f",&fnum) == 1)
+						if (fnum >= 0.0)
+							locopt.merge_tol = (float)fnum;
+					break;
 
-/*---------------------------------------------------------------------------*/
+				case 'm':
+					if (arg[2] == '\0' || strspn(&arg[2], "0123456789,-") != strlen(&arg[2])) {
+						stdprintf("Must give a list of models, e.g. -m0 or -m0,2-5\n");
+						show_help();
+						exit(1);
+					}
+					locopt.model_list = &arg[2];
+					break;
 
-void show_options(struct options_t *opt)
-  {
-	char   dirstr[80];
+				case 'f':
+					locopt.face_driven = 1;
+					break;
 
-	stdprintf("Options:\n");
-	stdprintf("  Scale down by: %.0f\n",opt->scaledown);
-	stdprintf("  Z scale: %.0f\n",opt->z_pad);
-	stdprintf("  Border: %.0f\n",opt->image_pad);
-	/* Zoffset calculations */
-	switch (opt->z_direction) {
-		case 0:
-			sprintf(dirstr,"up");
-			break;
-		case 1:
-			sprintf(dirstr,"up & right");
-			break;
-		case 2:
-			sprintf(dirstr,"right");
-			break;
-		case 3:
-			sprintf(dirstr,"down & right");
-			break;
-		case 4:
-			sprintf(dirstr,"down");
-			break;
-		case 5:
-			sprintf(dirstr,"down & left");
-			break;
-		case 6:
-			sprintf(dirstr,"left");
-			break;
-		case 7:
-			sprintf(dirstr,"up & left");
-			break;
-		default:
-			sprintf(dirstr,"unknown!");
+				case 'o':
+					locopt.hidden_lines = 1;
+					break;
+
+				case 'G':
+					locopt.floor_plan = 1;
+					break;
+
+				case 'E':
+					locopt.entity_overlay = 1;
+					break;
+
+				case 'A':
+					locopt.cam_angle[2] = 0.0;
+					if (sscanf(&arg[2],"%f,%f,%f",&locopt.cam_angle[0],&locopt.cam_angle[1],&locopt.cam_angle[2]) < 2) {
+						stdprintf("Camera angles must be given as yaw,pitch[,roll], e.g. -A45,30\n");
+						show_help();
+						exit(1);
+					}
+					locopt.free_camera = 1;
+					break;
+
+				case 'F':
+					if (sscanf(&arg[2],"%f",&locopt.cam_fov) != 1 || locopt.cam_fov <= 0.0 || locopt.cam_fov >= 180.0) {
+						stdprintf("Field of view must be between 0 and 180 degrees, e.g. -F60\n");
+						show_help();
+						exit(1);
+					}
+					locopt.free_camera = 1;
+					break;
+
+				case 'C':
+					if (sscanf(&arg[2],"%f,%f,%f",&locopt.cam_pos.X,&locopt.cam_pos.Y,&locopt.cam_pos.Z) != 3) {
+						stdprintf("Camera position must be given as x,y,z, e.g. -C0,-2048,512\n");
+						show_help();
+						exit(1);
+					}
+					locopt.cam_has_pos = 1;
+					locopt.free_camera = 1;
+					break;
+
+				case 'T':
+					if (sscanf(&arg[2],"%ld",&lnum) != 1 || lnum < 1) {
+						stdprintf("Number of frames must be at least 1, e.g. -T36\n");
+						show_help();
+						exit(1);
+					}
+					locopt.frames = (int)lnum;
+					locopt.free_camera = 1;
+					break;
+
+				case 'D':
+					if (arg[2] == '\0') {
+						stdprintf("Must give the map to compare with, e.g. -Dold/e1m1.bsp\n");
+						show_help();
+						exit(1);
+					}
+					locopt.diff_name = &arg[2];
+					break;
+
+				case 'H':
+					if (arg[2] == '\0') {
+						stdprintf("Must give a file for the height map, e.g. -He1m1.pgm\n");
+						show_help();
+						exit(1);
+					}
+					locopt.height_name = &arg[2];
+					break;
+
+				case 'L':
+					/* a number of slices, or the Z bounds between them */
+					j = 0;
+					pos = 2;
+					while (j <= MAX_LAYERS && sscanf(&arg[pos],"%f%n",&locopt.layer_z[j],&len) == 1) {
+						j++;
+						pos += len;
+						if (arg[pos] != ',')
+							break;
+						pos++;
+					}
+					if (arg[pos] != '\0')
+						j = 0;
+					for (k=1; k<j; k++) {
+						if (locopt.layer_z[k] <= locopt.layer_z[k-1])
+							j = 0;
+					}
+					if (j == 1 && locopt.layer_z[0] == floor(locopt.layer_z[0]) &&
+					    locopt.layer_z[0] >= 1 && locopt.layer_z[0] <= MAX_LAYERS) {
+						locopt.layers = (int)locopt.layer_z[0];
+						locopt.layer_has_z = 0;
+					} else if (j > 1) {
+						locopt.layers = j - 1;
+						locopt.layer_has_z = 1;
+					} else {
+						stdprintf("Layers must be a number (up to %d) or rising Z bounds, e.g. -L3 or -L-64,128,512\n",MAX_LAYERS);
+						show_help();
+						exit(1);
+					}
+					break;
+
+				case 'R':
+					if (sscanf(&arg[2],"%f,%f,%f,%f",&locopt.region[0],&locopt.region[1],&locopt.region[2],&locopt.region[3]) != 4 ||
+					    locopt.region[0] == locopt.region[2] || locopt.region[1] == locopt.region[3]) {
+						stdprintf("Region must be given as x0,y0,x1,y1, e.g. -R-256,-256,256,256\n");
+						show_help();
+						exit(1);
+					}
+					locopt.use_region = 1;
+					break;
+
+				case 'k':
+					switch(arg[2]) {
+						case 'g':
+							locopt.color_mode = COLOR_GRAY;
+							break;
+						case 'n':
+							locopt.color_mode = COLOR_NORMAL;
+							break;
+						case 'h':
+							locopt.color_mode = COLOR_HEIGHT;
+							break;
+						case 'm':
+							locopt.color_mode = COLOR_MODEL;
+							break;
+						case 'v':
+							locopt.color_mode = COLOR_VIS;
+							break;
+						default:
+							stdprintf("Color mode must be one of g, n, h, m, v.\n");
+							show_help();
+							exit(1);
+							break;
+					}
+					break;
+
+				case 'b':
+					if(sscanf(&arg[2],"%ld",&lnum) == 1)
+						if (lnum == 8 || lnum == 24)
+							locopt.bitcount = (int)lnum;
+					break;
+
+				case 'g':
+					if(sscanf(&arg[2],"%f",&fnum) == 1)
+						if (fnum > 0.0)
+							locopt.gamma = (float)fnum;
+					break;
+
+				case 'i':
+					if(sscanf(&arg[2],"%ld,%ld",&lnum,&lnum2) == 2 && lnum >= 0 && lnum2 <= 255 && lnum < lnum2) {
+						locopt.level_lo = (int)lnum;
+						locopt.level_hi = (int)lnum2;
+					} else {
+						stdprintf("Levels must be given as black,white, e.g. -i0,96\n");
+						show_help();
+						exit(1);
+					}
+					break;
+
+				case 'w':
+					locopt.thick_lines = 1;
+					break;
+
+				case 'v':
+					if (arg[2] == '\0') {
+						stdprintf("Must give a viewpoint, e.g. -v0,0,64, -vinfo_player_start or -v@points.txt\n");
+						show_help();
+						exit(1);
+					}
+					locopt.viewpoint = &arg[2];
+					break;
+
+				case 'x':
+				case 'X':
+					if (locopt.num_tex_exclude >= MAX_PATTERNS) {
+						stdprintf("Too many texture patterns.\n");
+						exit(1);
+					}
+					if (arg[1] == 'X')
+						locopt.tex_exclude[locopt.num_tex_exclude++] = DEFAULT_TEX_EXCLUDE;
+					else if (arg[2] != '\0')
+						locopt.tex_exclude[locopt.num_tex_exclude++] = &arg[2];
+					break;
+
+				case 'P':
+					locopt.plane_axes = 0;
+					for (j=2; arg[j] != '\0'; j++) {
+						switch(arg[j]) {
+							case 'x':
+							case 'X':
+								locopt.plane_axes |= 1;
+								break;
+							case 'y':
+							case 'Y':
+								locopt.plane_axes |= 2;
+								break;
+							case 'z':
+							case 'Z':
+								locopt.plane_axes |= 4;
+								break;
+							default:
+								stdprintf("Must specify axes out of x, y, z.\n");
+								show_help();
+								exit(1);
+								break;
+						}
+					}
+					break;
+				
+				default:
+					stdprintf("Unknown option: -%s\n",&arg[1]);
+					show_help();
+					exit (1);
+					break;
+			} /* switch */
+		} else {
+			if(locopt.bspf_name == NULL) {
+				locopt.bspf_name = arg;
+			} else if (locopt.outf_name == NULL) {
+				locopt.outf_name = arg;
+			} else {
+				stdprintf("Unknown option: %s\n",arg);
+				show_help();
+				exit(1);
+			}
+		} /* if */
+	} /* for */
+
+	/* a point to look from only means something in perspective */
+	if (locopt.cam_has_pos && locopt.cam_fov <= 0.0)
+		locopt.cam_fov = DEFAULT_FOV;
+
+	memcpy(opt, &locopt, sizeof(struct options_t));
+	return;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void show_options(struct options_t *opt)
+  {
+	char   dirstr[80];
+	int    i;
+
+	stdprintf("Options:\n");
+	stdprintf("  Scale down by: %.0f\n",opt->scaledown);
+	stdprintf("  Z scale: %.0f\n",opt->z_pad);
+	stdprintf("  Border: %.0f\n",opt->image_pad);
+	/* Zoffset calculations */
+	switch (opt->z_direction) {
+		case 0:
+			sprintf(dirstr,"up");
+			break;
+		case 1:
+			sprintf(dirstr,"up & right");
+			break;
+		case 2:
+			sprintf(dirstr,"right");
+			break;
+		case 3:
+			sprintf(dirstr,"down & right");
+			break;
+		case 4:
+			sprintf(dirstr,"down");
+			break;
+		case 5:
+			sprintf(dirstr,"down & left");
+			break;
+		case 6:
+			sprintf(dirstr,"left");
+			break;
+		case 7:
+			sprintf(dirstr,"up & left");
+			break;
+		default:
+			sprintf(dirstr,"unknown!");
+			break;
+	}
+
+	stdprintf("  Z direction: %d [%s]\n",opt->z_direction,dirstr);
+	if (opt->z_pad == 0) {
+		stdprintf("    Warning: direction option has no effect with Z scale set to 0.\n");
+	}
+
+	/* Camera axis */
+	switch (opt->camera_axis) {
+		case 1:
+			sprintf(dirstr,"+X");
+			break;
+		case -1:
+			sprintf(dirstr,"-X");
+			break;
+		case 2:
+			sprintf(dirstr,"+Y");
+			break;
+		case -2:
+			sprintf(dirstr,"-Y");
+			break;
+		case 3:
+			sprintf(dirstr,"+Z");
+			break;
+		case -3:
+			sprintf(dirstr,"-Z");
+			break;
+		default:
+			sprintf(dirstr,"unknown!");
+			break;
+	}
+
+	if (opt->free_camera) {
+		stdprintf("  Camera: yaw %.1f, pitch %.1f, roll %.1f, ", opt->cam_angle[0], opt->cam_angle[1], opt->cam_angle[2]);
+		if (opt->cam_fov > 0.0)
+			stdprintf("perspective (%.1f degrees)\n", opt->cam_fov);
+		else
+			stdprintf("orthographic\n");
+		if (opt->cam_has_pos)
+			stdprintf("    from (%.1f, %.1f, %.1f)\n", opt->cam_pos.X, opt->cam_pos.Y, opt->cam_pos.Z);
+	} else
+		stdprintf("  Camera axis: %s\n", dirstr);
+	stdprintf("  Remove extraneous edges: %s\n", (opt->edgeremove == 1) ? "yes" : "no");
+	stdprintf("  Edge removal dot product theshold: %f\n", opt->flat_threshold);
+	stdprintf("  Minimum polygon area threshold (approximate): %d\n", opt->area_threshold);
+	stdprintf("  Minimum line length threshold: %d\n", opt->linelen_threshold);
+	stdprintf("  Hidden line removal: %s\n", (opt->hidden_lines == 1) ? "yes" : "no");
+	stdprintf("  Floor plan: %s\n", (opt->floor_plan == 1) ? "yes" : "no");
+	stdprintf("  Creating %s image.\n", (opt->negative_image == 1) ? "negative" : "positive");
+	stdprintf("  Models: %s\n", (opt->model_list != NULL) ? opt->model_list : "all");
+	if (opt->plane_axes != 0)
+		stdprintf("  Faces along: %s%s%s\n", (opt->plane_axes & 1) ? "X" : "", (opt->plane_axes & 2) ? "Y" : "", (opt->plane_axes & 4) ? "Z" : "");
+	for (i=0; i<opt->num_tex_exclude; i++)
+		stdprintf("  Skipping textures: %s\n", opt->tex_exclude[i]);
+	if (opt->viewpoint != NULL)
+		stdprintf("  Visible from: %s\n", opt->viewpoint);
+	stdprintf("  Entity markers: %s\n", (opt->entity_overlay == 1) ? "yes" : "no");
+	if (opt->use_region)
+		stdprintf("  Region: %g,%g - %g,%g\n", opt->region[0], opt->region[1], opt->region[2], opt->region[3]);
+	if (opt->diff_name != NULL)
+		stdprintf("  Compare with: %s\n", opt->diff_name);
+	if (opt->height_name != NULL)
+		stdprintf("  Height map: %s (%s Z)\n", opt->height_name, (opt->height_min == 1) ? "lowest" : "highest");
+	if (opt->layers > 0 && opt->layer_has_z)
+		stdprintf("  Layers: %d, from Z %g to %g\n", opt->layers, opt->layer_z[0], opt->layer_z[opt->layers]);
+	else if (opt->layers > 0)
+		stdprintf("  Layers: %d\n", opt->layers);
+	stdprintf("  Color by: %s\n", (opt->color_mode == COLOR_NORMAL) ? "facing" : (opt->color_mode == COLOR_HEIGHT) ? "height" : (opt->color_mode == COLOR_MODEL) ? "model" : (opt->color_mode == COLOR_VIS) ? "visibility" : "nothing");
+	stdprintf("  Bits per pixel: %d\n", opt->bitcount);
+	stdprintf("  Gamma: %f, levels: %d-%d\n", opt->gamma, opt->level_lo, opt->level_hi);
+	stdprintf("  Thick lines: %s\n", (opt->thick_lines == 1) ? "yes" : "no");
+	stdprintf("  Line joining tolerance: %f pixels\n", opt->merge_tol);
+	stdprintf("  Face-driven: %s\n", (opt->face_driven || opt->model_list != NULL || opt->plane_axes != 0 || opt->num_tex_exclude > 0 || opt->viewpoint != NULL) ? "yes" : "no");
+
+	stdprintf("\n");
+	stdprintf("  Input (bsp) file: %s\n",opt->bspf_name);
+	if(opt->write_svg)
+		stdprintf("  Output (svg) file: %s\n\n",opt->outf_name);
+	else if(opt->write_raw)
+		stdprintf("  Output (raw) file: %s\n\n",opt->outf_name);
+	else
+		stdprintf("  Output (%s bmp) file: %s\n\n",opt->write_nocomp ? "uncompressed" : "RLE compressed" ,opt->outf_name);
+
+	return;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Little-endian readers for the mmap'd data */
+long get_long(eightbit *p) {
+	return (long)(int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	                       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+unsigned short get_short(eightbit *p) {
+	return (unsigned short)(p[0] | (p[1] << 8));
+}
+
+float get_float(eightbit *p) {
+	union {
+		uint32_t	i;
+		float		f;
+	} u;
+
+	u.i = (uint32_t)get_long(p);
+	return u.f;
+}
+
+/* ... and the other way, for the bmp headers; 1 if written */
+int put_long(FILE *f, long v) {
+	eightbit	b[4];
+
+	b[0] = (eightbit)(v & 0xff);
+	b[1] = (eightbit)((v >> 8) & 0xff);
+	b[2] = (eightbit)((v >> 16) & 0xff);
+	b[3] = (eightbit)((v >> 24) & 0xff);
+	return (int)fwrite(b, 4, 1, f);
+}
+
+int put_short(FILE *f, unsigned short v) {
+	eightbit	b[2];
+
+	b[0] = (eightbit)(v & 0xff);
+	b[1] = (eightbit)((v >> 8) & 0xff);
+	return (int)fwrite(b, 2, 1, f);
+}
+
+/* "-" for stdin or stdout */
+int is_stdio(char *name) {
+	return name != NULL && strcmp(name, "-") == 0;
+}
+
+/* A bsp read from stdin: "-", or "-:entry" for a map in an archive */
+int from_stdin(char *name) {
+	return is_stdio(name) || (name != NULL && strncmp(name, "-:", 2) == 0);
+}
+
+/* All of a pipe (or file) into memory, the buffer doubling as it fills */
+eightbit *read_stream(int fd, long *size) {
+	eightbit	*buf = NULL, *nb;
+	long		 len = 0, cap = 0;
+	ssize_t		 n;
+
+	for (;;) {
+		if (len == cap) {
+			cap = (cap > 0) ? cap * 2 : 1 << 20;
+			nb = realloc(buf, cap);
+			if (nb == NULL) {
+				free(buf);
+				return NULL;
+			}
+			buf = nb;
+		}
+		n = read(fd, buf + len, cap - len);
+		if (n < 0) {
+			if (errno == EINTR && !cancelled)
+				continue;
+			free(buf);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	if (len == 0) {
+		free(buf);
+		return NULL;
+	}
+	*size = len;
+	return buf;
+}
+
+void get_dentry(struct dentry_t *lump, eightbit *p) {
+	lump->offset = get_long(p);
+	lump->size   = get_long(p + 4);
+	return;
+}
+
+void get_vertex(struct vertex_t *v, eightbit *p) {
+	v->X = get_float(p);
+	v->Y = get_float(p + 4);
+	v->Z = get_float(p + 8);
+	return;
+}
+
+/* The header: the version, then the lump directory */
+void get_header(struct dheader_t *hdr, eightbit *p) {
+	hdr->version = get_long(p);
+	get_dentry(&hdr->entities,  p + 4);
+	get_dentry(&hdr->planes,    p + 12);
+	get_dentry(&hdr->miptex,    p + 20);
+	get_dentry(&hdr->vertices,  p + 28);
+	get_dentry(&hdr->visilist,  p + 36);
+	get_dentry(&hdr->nodes,     p + 44);
+	get_dentry(&hdr->texinfo,   p + 52);
+	get_dentry(&hdr->faces,     p + 60);
+	get_dentry(&hdr->lightmaps, p + 68);
+	get_dentry(&hdr->clipnodes, p + 76);
+	get_dentry(&hdr->leaves,    p + 84);
+	get_dentry(&hdr->iface,     p + 92);
+	get_dentry(&hdr->edges,     p + 100);
+	get_dentry(&hdr->ledges,    p + 108);
+	get_dentry(&hdr->models,    p + 116);
+	return;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* mmap a whole file read-only. Returns NULL on error. */
+eightbit *map_file(char *fname, long *size) {
+	int		 fd;
+	struct stat	 st;
+	void		*map;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*size = (long)st.st_size;
+	return (eightbit *)map;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Recognize a pak or pk3 and locate its directory. Returns ARC_NONE if the
+   data is neither (or the directory is broken). */
+int open_archive(struct archive_t *arc, eightbit *data, long size) {
+	long	i;
+
+	arc->data = data;
+	arc->size = size;
+	arc->type = ARC_NONE;
+
+	if (size >= 12 && memcmp(data, "PACK", 4) == 0) {
+		arc->dirofs = get_long(data + 4);
+		arc->dirend = arc->dirofs + get_long(data + 8);
+		if (arc->dirofs < 12 || arc->dirend < arc->dirofs || arc->dirend > size)
+			return ARC_NONE;
+		arc->type = ARC_PAK;
+	} else if (size >= 22 && memcmp(data, "PK\003\004", 4) == 0) {
+		/* find the end of central directory record, it may be followed by a comment */
+		for (i = size - 22; i >= 0 && i >= size - 22 - 65535; i--) {
+			if (memcmp(data + i, "PK\005\006", 4) == 0)
+				break;
+		}
+		if (i < 0 || i < size - 22 - 65535)
+			return ARC_NONE;
+
+		arc->dirofs = get_long(data + i + 16);
+		arc->dirend = arc->dirofs + get_long(data + i + 12);
+		if (arc->dirofs < 0 || arc->dirend < arc->dirofs || arc->dirend > i)
+			return ARC_NONE;
+		arc->type = ARC_PK3;
+	}
+
+	return arc->type;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Fill in the archive entry at directory position pos (start with
+   arc->dirofs). Returns the position of the next entry, or -1 at the end of
+   the directory or on a broken entry. */
+long next_entry(struct archive_t *arc, long pos, struct arcentry_t *ent) {
+	eightbit	*p;
+	long		 namelen, local;
+
+	if (arc->type == ARC_PAK) {
+		if (pos + 64 > arc->dirend)
+			return -1;
+
+		p = arc->data + pos;
+		memcpy(ent->name, p, 56);
+		ent->name[56] = '\0';
+		ent->offset = get_long(p + 56);
+		ent->size   = get_long(p + 60);
+		ent->csize  = ent->size;
+		ent->method = 0;
+		pos = pos + 64;
+	} else if (arc->type == ARC_PK3) {
+		if (pos + 46 > arc->dirend || memcmp(arc->data + pos, "PK\001\002", 4) != 0)
+			return -1;
+
+		p = arc->data + pos;
+		ent->method = get_short(p + 10);
+		ent->csize  = get_long(p + 20);
+		ent->size   = get_long(p + 24);
+		namelen     = get_short(p + 28);
+		local       = get_long(p + 42);
+		if (pos + 46 + namelen > arc->dirend || namelen >= MAX_NAME)
+			return -1;
+
+		memcpy(ent->name, p + 46, namelen);
+		ent->name[namelen] = '\0';
+
+		/* data follows the local header, whose extra field may differ */
+		if (local < 0 || local + 30 > arc->size || memcmp(arc->data + local, "PK\003\004", 4) != 0)
+			return -1;
+		ent->offset = local + 30 + get_short(arc->data + local + 26) + get_short(arc->data + local + 28);
+		pos = pos + 46 + namelen + get_short(p + 30) + get_short(p + 32);
+	} else {
+		return -1;
+	}
+
+	/* (a stored entry is used in place, all ent->size bytes of it) */
+	if (ent->offset < 0 || ent->csize < 0 || ent->size < 0 || ent->offset + ent->csize > arc->size ||
+	    (ent->method == 0 && ent->size != ent->csize))
+		return -1;
+
+	return pos;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Point bsp at an archive entry. Stored entries are used in place, deflated
+   ones are inflated straight into the bsp buffer. */
+int load_entry(struct archive_t *arc, struct arcentry_t *ent, struct bspdata_t *bsp) {
+	z_stream	zs;
+	int		err;
+
+	bsp->map = NULL;
+	bsp->buffer = NULL;
+	bsp->stream = NULL;
+
+	if (ent->method == 0) {
+		bsp->data = arc->data + ent->offset;
+		bsp->size = ent->size;
+		return 0;
+	}
+
+	if (ent->method != Z_DEFLATED) {
+		fprintf(stderr,"Unsupported compression method %d for %s.\n",ent->method,ent->name);
+		return 1;
+	}
+
+	bsp->buffer = malloc(ent->size > 0 ? ent->size : 1);
+	if (bsp->buffer == NULL) {
+		fprintf(stderr,"Error allocating %ld bytes for %s.\n",ent->size,ent->name);
+		return 2;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		fprintf(stderr,"Error initializing inflate for %s.\n",ent->name);
+		free(bsp->buffer);
+		bsp->buffer = NULL;
+		return 1;
+	}
+	zs.next_in   = arc->data + ent->offset;
+	zs.avail_in  = (uInt)ent->csize;
+	zs.next_out  = bsp->buffer;
+	zs.avail_out = (uInt)ent->size;
+	err = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+
+	if (err != Z_STREAM_END || zs.total_out != (uLong)ent->size) {
+		fprintf(stderr,"Error inflating %s (%s).\n",ent->name,zs.msg ? zs.msg : "size mismatch");
+		free(bsp->buffer);
+		bsp->buffer = NULL;
+		return 1;
+	}
+
+	bsp->data = bsp->buffer;
+	bsp->size = ent->size;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void close_bsp(struct bspdata_t *bsp) {
+	if (bsp->buffer != NULL)
+		free(bsp->buffer);
+	if (bsp->map != NULL)
+		munmap(bsp->map, bsp->mapsize);
+	if (bsp->stream != NULL)
+		free(bsp->stream);
+
+	bsp->buffer = NULL;
+	bsp->map = NULL;
+	bsp->stream = NULL;
+	bsp->data = NULL;
+	return;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Open <file> or <archive>:<entry>; - reads the file from stdin */
+int open_bsp(char *name, struct bspdata_t *bsp) {
+	struct archive_t	 arc;
+	struct arcentry_t	 ent;
+	struct stat		 st;
+	char			*entry;
+	eightbit		*map, *stream = NULL;
+	long			 mapsize, pos;
+	int			 err;
+
+	strncpy(bsp->name, name, MAX_NAME - 1);
+	bsp->name[MAX_NAME - 1] = '\0';
+	bsp->entry[0] = '\0';
+	bsp->map = NULL;
+	bsp->buffer = NULL;
+	bsp->stream = NULL;
+
+	/* Plain file? */
+	entry = strrchr(name, ':');
+	if (is_stdio(name)) {
+		bsp->stream = read_stream(0, &mapsize);
+		if (bsp->stream == NULL)
+			return 1;
+		bsp->data = bsp->stream;
+		bsp->size = mapsize;
+		return 0;
+	}
+	if (entry == NULL || stat(name, &st) == 0) {
+		map = map_file(name, &mapsize);
+		if (map == NULL)
+			return 1;
+		bsp->map = bsp->data = map;
+		bsp->mapsize = bsp->size = mapsize;
+		return 0;
+	}
+
+	/* archive:entry */
+	if (entry - name >= MAX_NAME)
+		return 1;
+	bsp->name[entry - name] = '\0';
+	entry++;
+	strncpy(bsp->entry, entry, MAX_NAME - 1);
+	bsp->entry[MAX_NAME - 1] = '\0';
+
+	/* (an archive from stdin is read in whole and freed, not unmapped) */
+	if (is_stdio(bsp->name)) {
+		map = stream = read_stream(0, &mapsize);
+	} else {
+		map = map_file(bsp->name, &mapsize);
+	}
+	if (map == NULL)
+		return 1;
+	if (open_archive(&arc, map, mapsize) == ARC_NONE) {
+		fprintf(stderr,"%s is not a pak or pk3 file.\n",bsp->name);
+		err = 1;
+	} else {
+		for (pos = arc.dirofs; (pos = next_entry(&arc, pos, &ent)) >= 0; ) {
+			if (strcasecmp(ent.name, entry) == 0)
+				break;
+		}
+		if (pos < 0) {
+			fprintf(stderr,"No %s in %s.\n",entry,bsp->name);
+			err = 1;
+		} else {
+			err = load_entry(&arc, &ent, bsp);
+		}
+	}
+
+	/* keep the archive as long as the bsp */
+	if (stream != NULL) {
+		bsp->stream = stream;
+	} else {
+		bsp->map = map;
+		bsp->mapsize = mapsize;
+	}
+	if (err)
+		close_bsp(bsp);
+	return err;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Output name for a map: <base>.bmp in outdir if given, otherwise in the
+   directory of the bsp (or the archive it came from). */
+char *make_outname(char *fname, char *entry, char *outdir, char *ext) {
+	char	*base, *dir, *slash, *dot, *out;
+	long	 dirlen;
+
+	base = (entry != NULL) ? entry : fname;
+	slash = strrchr(base, '/');
+	if (slash == NULL)
+		slash = strrchr(base, '\\');
+	if (slash != NULL)
+		base = slash + 1;
+
+	if (outdir != NULL) {
+		dir = outdir;
+		dirlen = strlen(outdir);
+	} else {
+		dir = fname;
+		slash = strrchr(fname, '/');
+		if (slash == NULL)
+			slash = strrchr(fname, '\\');
+		dirlen = (slash != NULL) ? (slash - fname + 1) : 0;
+	}
+
+	out = malloc(dirlen + strlen(base) + strlen(ext) + 2);
+	if (out == NULL)
+		return NULL;
+
+	memcpy(out, dir, dirlen);
+	out[dirlen] = '\0';
+	if (outdir != NULL && dirlen > 0 && out[dirlen-1] != '/' && out[dirlen-1] != '\\')
+		strcat(out, "/");
+	strcat(out, base);
+	dot = strrchr(out + dirlen, '.');
+	if (dot != NULL)
+		*dot = '\0';
+	strcat(out, ext);
+
+	return out;
+}
+
+/* name.bmp -> name-<n>.bmp into out (size bytes), for the layers of -L */
+void layer_name(char *out, long size, char *name, int n) {
+	char	*dot, *slash;
+
+	dot = strrchr(name, '.');
+	slash = strrchr(name, '/');
+	if (dot == NULL || (slash != NULL && dot < slash))
+		dot = name + strlen(name);
+	snprintf(out, size, "%.*s-%d%s", (int)(dot - name), name, n, dot);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Case-insensitive match of name against one pattern of a comma-separated
+   list; '*' matches any run of characters, '?' any one character. */
+int match_pattern(char *pat, char *name) {
+	for (; *pat != '\0' && *pat != ','; pat++, name++) {
+		if (*pat == '*') {
+			while (!match_pattern(pat + 1, name)) {
+				if (*name == '\0')
+					return 0;
+				name++;
+			}
+			return 1;
+		}
+		if (*name == '\0')
+			return 0;
+		if (*pat != '?' && tolower((unsigned char)*pat) != tolower((unsigned char)*name))
+			return 0;
+	}
+
+	return (*name == '\0');
+}
+
+/* Does name match any pattern of a "sky*,*water*,clip" style list? */
+int match_list(char *list, char *name) {
+	while (*list != '\0') {
+		if (match_pattern(list, name))
+			return 1;
+		while (*list != '\0' && *list != ',')
+			list++;
+		if (*list == ',')
+			list++;
+	}
+
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Read one string or brace token of the entities lump, without copying.
+   Returns the position after it, or NULL at the end of the lump. */
+char *get_token(char *p, char *end, char **token, long *len) {
+	while (p < end && *p != '\0' && isspace((unsigned char)*p))
+		p++;
+	if (p >= end || *p == '\0')
+		return NULL;
+
+	if (*p == '"') {
+		*token = ++p;
+		while (p < end && *p != '"')
+			p++;
+		*len = p - *token;
+		return (p < end) ? p + 1 : p;
+	}
+
+	*token = p;
+	*len = 1;
+	return p + 1;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Parse the next { "key" "value" ... } block of the entities lump.
+   Returns the position after it, or NULL when there are no more. */
+char *next_entity(char *p, char *end, struct entity_t *ent) {
+	char	*key, *value;
+	long	 keylen, valuelen;
+	char	 buf[64];
+
+	ent->classname = "";
+	ent->classname_len = 0;
+	ent->has_origin = 0;
+	ent->model = -1;
+
+	/* find the opening brace */
+	do {
+		p = get_token(p, end, &key, &keylen);
+		if (p == NULL)
+			return NULL;
+	} while (*key != '{');
+
+	for (;;) {
+		p = get_token(p, end, &key, &keylen);
+		if (p == NULL || *key == '}')
+			return p;
+		p = get_token(p, end, &value, &valuelen);
+		if (p == NULL)
+			return NULL;
+
+		if (keylen == 9 && strncmp(key, "classname", 9) == 0) {
+			ent->classname = value;
+			ent->classname_len = valuelen;
+		} else if (keylen == 6 && strncmp(key, "origin", 6) == 0 && valuelen < (long)sizeof(buf)) {
+			memcpy(buf, value, valuelen);
+			buf[valuelen] = '\0';
+			ent->has_origin = (sscanf(buf, "%f %f %f", &ent->origin.X, &ent->origin.Y, &ent->origin.Z) == 3);
+		} else if (keylen == 5 && strncmp(key, "model", 5) == 0 && valuelen > 1 && valuelen < (long)sizeof(buf) && *value == '*') {
+			memcpy(buf, value + 1, valuelen - 1);
+			buf[valuelen - 1] = '\0';
+			ent->model = atol(buf);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Which marker, if any, an entity gets on the overlay */
+int entity_marker(struct entity_t *ent) {
+	static struct {
+		char	*prefix;
+		int	 shape;
+	} classes[] = {
+		{ "info_player_",              MARK_SPAWN },
+		{ "item_",                     MARK_ITEM },
+		{ "weapon_",                   MARK_ITEM },
+		{ "trigger_teleport",          MARK_TELE },
+		{ "info_teleport_destination", MARK_TELE },
+		{ "monster_",                  MARK_MONSTER },
+		{ NULL,                        MARK_NONE }
+	};
+	long	i, len;
+
+	for (i=0; classes[i].prefix != NULL; i++) {
+		len = strlen(classes[i].prefix);
+		if (ent->classname_len >= len && strncmp(ent->classname, classes[i].prefix, len) == 0)
+			return classes[i].shape;
+	}
+
+	return MARK_NONE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void draw_marker(struct canvas_t *canvas, long x, long y, int shape) {
+	struct canvas_t	 flat;
+	long		 r=MARKER_SIZE;
+	unsigned int	 c=(canvas->bpp == 3) ? 0xffffff : 255;
+
+	/* markers aren't part of the map, so stay out of the height map */
+	flat = *canvas;
+	flat.zmap = NULL;
+	canvas = &flat;
+
+	/* corners first, bresline leaves them out */
+	switch (shape) {
+		case MARK_SPAWN:
+			plotpoint(canvas, x-r, y-r, c);
+			plotpoint(canvas, x+r, y+r, c);
+			plotpoint(canvas, x-r, y+r, c);
+			plotpoint(canvas, x+r, y-r, c);
+			bresline(canvas, NULL, x-r, y-r, 0.0, x+r, y+r, 0.0, c);
+			bresline(canvas, NULL, x-r, y+r, 0.0, x+r, y-r, 0.0, c);
+			break;
+
+		case MARK_ITEM:
+			plotpoint(canvas, x-r, y-r, c);
+			plotpoint(canvas, x+r, y-r, c);
+			plotpoint(canvas, x+r, y+r, c);
+			plotpoint(canvas, x-r, y+r, c);
+			bresline(canvas, NULL, x-r, y-r, 0.0, x+r, y-r, 0.0, c);
+			bresline(canvas, NULL, x+r, y-r, 0.0, x+r, y+r, 0.0, c);
+			bresline(canvas, NULL, x+r, y+r, 0.0, x-r, y+r, 0.0, c);
+			bresline(canvas, NULL, x-r, y+r, 0.0, x-r, y-r, 0.0, c);
+			break;
+
+		case MARK_TELE:
+			plotpoint(canvas, x, y-r, c);
+			plotpoint(canvas, x+r, y, c);
+			plotpoint(canvas, x, y+r, c);
+			plotpoint(canvas, x-r, y, c);
+			bresline(canvas, NULL, x, y-r, 0.0, x+r, y, 0.0, c);
+			bresline(canvas, NULL, x+r, y, 0.0, x, y+r, 0.0, c);
+			bresline(canvas, NULL, x, y+r, 0.0, x-r, y, 0.0, c);
+			bresline(canvas, NULL, x-r, y, 0.0, x, y-r, 0.0, c);
+			break;
+
+		case MARK_MONSTER:
+			plotpoint(canvas, x, y-r, c);
+			plotpoint(canvas, x+r, y+r, c);
+			plotpoint(canvas, x-r, y+r, c);
+			bresline(canvas, NULL, x, y-r, 0.0, x+r, y+r, 0.0, c);
+			bresline(canvas, NULL, x+r, y+r, 0.0, x-r, y+r, 0.0, c);
+			bresline(canvas, NULL, x-r, y+r, 0.0, x, y-r, 0.0, c);
 			break;
+
+		default:
+			break;
+	}
+
+	return;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* GCC's vector extensions, four edges at a time; other compilers get the
+   plain loop alone */
+#if defined(__GNUC__) && (__GNUC__ >= 9 || defined(__clang__))
+#define VECTOR_EDGES
+typedef int   v4si __attribute__ ((vector_size (16)));
+typedef float v4sf __attribute__ ((vector_size (16)));
+#endif
+
+/* The keep/drop test for edges, with the edges laid out one array per
+   quantity: flat is the product of the dot products of the faces on the
+   edge, area the smallest of their areas and len2 its squared length.
+   The positions of the edges kept go to keep[]; counts[] gets how many
+   failed the flatness, area and length tests, by the first they failed.
+   A block of edges at a time, the tests go in one pass with no branches,
+   leaving 1 in pass[] for each edge kept, and a second pass writes out
+   the positions of those. Returns the number kept. */
+long classify_edges(long num, float *flat, int *area, float *len2, struct options_t *opt, long *keep, long *counts) {
+	long	n, base, end, numkeep = 0;
+	long	nflat = 0, narea = 0, nlen = 0;
+	int	pf, pa, pl;
+	int	pass[EDGE_BLOCK];
+	float	flat_thr = opt->flat_threshold;
+	int	area_thr = opt->area_threshold;
+	double	len2_thr;
+	float	len2_f;
+#ifdef VECTOR_EDGES
+	v4si	vf, va, vs, vpf, vpa, vpl;
+	v4si	cf = {0, 0, 0, 0}, ca = cf, cl = cf, at = cf + area_thr;
+	v4sf	fl, ln, ft = {0.0, 0.0, 0.0, 0.0}, lt;
+	int	k;
+#endif
+
+	/* len > t is len^2 > t^2, saves a sqrt per edge */
+	if (opt->linelen_threshold > 0)
+		len2_thr = (double)opt->linelen_threshold * (double)opt->linelen_threshold;
+	else
+		len2_thr = (opt->linelen_threshold < 0) ? -1.0 : 0.0;
+	/* the same test in float: against the largest float not above it */
+	len2_f = (float)len2_thr;
+	if ((double)len2_f > len2_thr)
+		len2_f = nextafterf(len2_f, -HUGE_VALF);
+#ifdef VECTOR_EDGES
+	lt = ft + len2_f;
+	ft = ft + flat_thr;
+#endif
+
+	for (base=0; base<num; base=end) {
+		end = (num - base > EDGE_BLOCK) ? base + EDGE_BLOCK : num;
+		n = base;
+#ifdef VECTOR_EDGES
+		for (; n+4<=end; n+=4) {
+			memcpy(&fl, &flat[n], sizeof(fl));
+			memcpy(&va, &area[n], sizeof(va));
+			memcpy(&ln, &len2[n], sizeof(ln));
+			vf = __builtin_convertvector(fl, v4si);
+			vs = vf >> 31;
+			vf = (vf ^ vs) - vs;
+			/* a true compare is -1 in each lane */
+			vpf = __builtin_convertvector(vf, v4sf) < ft;
+			vpa = va > at;
+			vpl = ln > lt;
+			cf -= ~vpf;
+			ca -= vpf & ~vpa;
+			cl -= vpf & vpa & ~vpl;
+			vs = -(vpf & vpa & vpl);
+			memcpy(&pass[n - base], &vs, sizeof(vs));
+		}
+#endif
+		for (; n<end; n++) {
+			/* abs() of an int, as it has always been: only a product
+			   of +-1 (faces exactly in line) counts as flat */
+			pf = abs((int)flat[n]) < flat_thr;
+			pa = area[n] > area_thr;
+			pl = len2[n] > len2_f;
+			nflat += !pf;
+			narea += pf & !pa;
+			nlen += pf & pa & !pl;
+			pass[n - base] = pf & pa & pl;
+		}
+
+		/* no branch here either, kept edges are about as often as not */
+		for (n=base; n<end; n++) {
+			keep[numkeep] = n;
+			numkeep += pass[n - base];
+		}
+	}
+
+#ifdef VECTOR_EDGES
+	for (k=0; k<4; k++) {
+		nflat += cf[k];
+		narea += ca[k];
+		nlen += cl[k];
+	}
+#endif
+	counts[0] = nflat;
+	counts[1] = narea;
+	counts[2] = nlen;
+	return numkeep;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Join segments that share a vertex (and a color and layers) into chains.
+   Chain c is the vertices pts[start[c]] .. pts[start[c+1]-1] in color
+   col[c] on layers lay[c]; pts needs room for 2 * numseg entries, start,
+   col and lay for numseg + 1. Returns the number of chains, or -1 if out
+   of memory. */
+long make_chains(struct segment_t *seg, long numseg, long numverts, long *pts, long *start, unsigned int *col, uint32_t *lay) {
+	long	*first, *adj, *back;
+	char	*used;
+	long	 i, j, s, t, v, n, nb, numchains=0;
+
+	first = calloc(numverts + 1, sizeof(long));
+	adj = malloc(sizeof(long) * (numseg * 2 + 1));
+	back = malloc(sizeof(long) * (numseg + 1));
+	used = calloc(numseg + 1, 1);
+	if (first == NULL || adj == NULL || back == NULL || used == NULL) {
+		free(first);
+		free(adj);
+		free(back);
+		free(used);
+		return -1;
+	}
+
+	/* vertex -> segments, as runs in adj */
+	for (s=0; s<numseg; s++) {
+		first[seg[s].v0]++;
+		first[seg[s].v1]++;
+	}
+	for (v=0, n=0; v<=numverts; v++) {
+		t = (v < numverts) ? first[v] : 0;
+		first[v] = n;
+		n += t;
+	}
+	for (s=0; s<numseg; s++) {
+		adj[first[seg[s].v0]++] = s;
+		adj[first[seg[s].v1]++] = s;
+	}
+	for (v=numverts; v>0; v--)
+		first[v] = first[v-1];
+	first[0] = 0;
+
+	n = 0;
+	for (s=0; s<numseg; s++) {
+		if (used[s])
+			continue;
+		used[s] = 1;
+		col[numchains] = seg[s].color;
+		lay[numchains] = seg[s].layers;
+		start[numchains++] = n;
+
+		/* walk backwards from v0, then forwards from v1 */
+		nb = 0;
+		v = seg[s].v0;
+		for (i=first[v]; i<first[v+1]; i++) {
+			t = adj[i];
+			if (used[t] || seg[t].color != seg[s].color || seg[t].layers != seg[s].layers)
+				continue;
+			used[t] = 1;
+			v = (seg[t].v0 == v) ? seg[t].v1 : seg[t].v0;
+			back[nb++] = v;
+			i = first[v] - 1;
+		}
+		for (j=nb-1; j>=0; j--)
+			pts[n++] = back[j];
+		pts[n++] = seg[s].v0;
+		pts[n++] = seg[s].v1;
+
+		v = seg[s].v1;
+		for (i=first[v]; i<first[v+1]; i++) {
+			t = adj[i];
+			if (used[t] || seg[t].color != seg[s].color || seg[t].layers != seg[s].layers)
+				continue;
+			used[t] = 1;
+			v = (seg[t].v0 == v) ? seg[t].v1 : seg[t].v0;
+			pts[n++] = v;
+			i = first[v] - 1;
+		}
+	}
+	start[numchains] = n;
+
+	free(first);
+	free(adj);
+	free(back);
+	free(used);
+	return numchains;
+}
+
+/* Drop the points of a chain that lie within tol pixels of the line
+   through their neighbours (tol 0 still drops exactly collinear ones).
+   Returns the new number of points. */
+long simplify_chain(long *pts, long num, float *sx, float *sy, float tol) {
+	long	i, n;
+	float	dx, dy, len, dist;
+
+	if (num < 3)
+		return num;
+
+	n = 1;
+	for (i=1; i<num-1; i++) {
+		/* distance of point i from the line pts[n-1] -> pts[i+1] */
+		dx = sx[pts[i+1]] - sx[pts[n-1]];
+		dy = sy[pts[i+1]] - sy[pts[n-1]];
+		len = sqrt(dx * dx + dy * dy);
+		dist = (dx * (sy[pts[i]] - sy[pts[n-1]]) - dy * (sx[pts[i]] - sx[pts[n-1]]));
+		if (len > 0.0 && fabs(dist) <= (tol + 0.001) * len &&
+		    (sx[pts[i]] - sx[pts[n-1]]) * dx + (sy[pts[i]] - sy[pts[n-1]]) * dy >= 0.0 &&
+		    (sx[pts[i+1]] - sx[pts[i]]) * dx + (sy[pts[i+1]] - sy[pts[i]]) * dy >= 0.0)
+			continue;
+		pts[n++] = pts[i];
+	}
+	pts[n++] = pts[num-1];
+
+	return n;
+}
+
+/* Write the height map as a 16-bit binary PGM (big-endian, rows top down);
+   1..65535 is lo..hi, 0 where nothing was drawn. The comment keeps lo and
+   hi so the heights can be got back. Returns the bytes written, -1 if it
+   couldn't be. */
+long write_height(char *name, uint16_t *zmap, long width, long height, float lo, float hi) {
+	FILE		*f;
+	eightbit	*row;
+	long		 x, y, len;
+	int		 err=0;
+
+	if ((row = malloc(width * 2)) == NULL)
+		return -1;
+	if (is_stdio(name))
+		f = stdout;
+	else if ((f = fopen(name, "wb")) == NULL) {
+		free(row);
+		return -1;
+	}
+
+	fprintf(f, "P5\n# z %g %g\n%ld %ld\n65535\n", lo, hi, width, height);
+	for (y=0; y<height && !err; y++) {
+		for (x=0; x<width; x++) {
+			row[x*2]   = (eightbit)(zmap[y * width + x] >> 8);
+			row[x*2+1] = (eightbit)(zmap[y * width + x] & 0xff);
+		}
+		if (fwrite(row, width * 2, 1, f) != 1)
+			err = 1;
+	}
+	free(row);
+
+	len = ftell(f);
+	if (f == stdout) {
+		if (fflush(f) != 0)
+			err = 1;
+	} else if (fclose(f) != 0)
+		err = 1;
+	if (err)
+		return -1;
+	return (len > 0) ? len : 0;
+}
+
+/* Write chains of screen space points as SVG polylines. Coordinates are
+   kept in tenths of a pixel, which is plenty and keeps the file small. */
+int write_svg(FILE *out, struct options_t *opt, long width, long height, eightbit *lut,
+              long *pts, long *start, long numchains, float *sx, float *sy, unsigned int *chain_col) {
+	long		 c, i, col=-1;
+	unsigned int	 rgb;
+	float		 minx, maxx, miny, maxy;
+
+	fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(out, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%ld\" height=\"%ld\" viewBox=\"0 0 %ld %ld\">\n",
+	        width, height, width * 10, height * 10);
+	fprintf(out, "<rect width=\"100%%\" height=\"100%%\" fill=\"#%02x%02x%02x\"/>\n", lut[0], lut[0], lut[0]);
+	fprintf(out, "<g fill=\"none\" stroke-width=\"%d\" stroke-linecap=\"round\" stroke-linejoin=\"round\">\n",
+	        opt->thick_lines ? 30 : 10);
+
+	for (c=0; c<numchains && !cancelled; c++) {
+		/* skip chains that are wholly off the picture */
+		for (i=start[c]; i<start[c+1]; i++) {
+			if (sx[pts[i]] >= 0.0 && sx[pts[i]] <= (float)width && sy[pts[i]] >= 0.0 && sy[pts[i]] <= (float)height)
+				break;
+		}
+		if (i == start[c+1] && start[c+1] - start[c] > 0) {
+			minx = maxx = sx[pts[start[c]]];
+			miny = maxy = sy[pts[start[c]]];
+			for (i=start[c]; i<start[c+1]; i++) {
+				minx = fmin(minx, sx[pts[i]]);
+				maxx = fmax(maxx, sx[pts[i]]);
+				miny = fmin(miny, sy[pts[i]]);
+				maxy = fmax(maxy, sy[pts[i]]);
+			}
+			if (maxx < 0.0 || minx > (float)width || maxy < 0.0 || miny > (float)height)
+				continue;
+		}
+
+		/* a group per run of chains of the same color */
+		rgb = (lut[(chain_col[c] >> 16) & 0xff] << 16) | (lut[(chain_col[c] >> 8) & 0xff] << 8) | lut[chain_col[c] & 0xff];
+		if ((long)rgb != col) {
+			if (col >= 0)
+				fprintf(out, "</g>\n");
+			fprintf(out, "<g stroke=\"#%06x\">\n", rgb);
+			col = rgb;
+		}
+
+		fprintf(out, "<polyline points=\"");
+		for (i=start[c]; i<start[c+1]; i++) {
+			fprintf(out, "%s%ld,%ld", (i > start[c]) ? " " : "",
+			        (long)floor(sx[pts[i]] * 10.0 + 0.5), (long)floor(sy[pts[i]] * 10.0 + 0.5));
+		}
+		fprintf(out, "\"/>\n");
+	}
+	if (col >= 0)
+		fprintf(out, "</g>\n");
+	fprintf(out, "</g>\n</svg>\n");
+
+	return ferror(out) ? 1 : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Walk the bsp tree from headnode down to the leaf holding pt */
+long find_leaf(struct node_t *nodes, long numnodes, struct plane_t *planes, long headnode, struct vertex_t *pt) {
+	long	node=headnode, child, depth=0;
+	float	d;
+
+	while (node >= 0 && node < numnodes && depth++ < numnodes) {
+		d = planes[nodes[node].plane_id].normal.X * pt->X +
+		    planes[nodes[node].plane_id].normal.Y * pt->Y +
+		    planes[nodes[node].plane_id].normal.Z * pt->Z - planes[nodes[node].plane_id].dist;
+		child = (d >= 0.0) ? nodes[node].front : nodes[node].back;
+		if (child < 0)
+			return -(child + 1);
+		node = child;
+	}
+
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Unpack one row of the run-length encoded vis lump into row: bit n is set
+   if leaf n+1 can be seen. A leaf without vis info sees everything. */
+void decompress_vis(eightbit *vis, long vissize, long ofs, eightbit *row, long rowsize) {
+	eightbit	*in, *end, *out;
+	long		 count;
+
+	if (ofs < 0 || ofs >= vissize) {
+		memset(row, 0xff, rowsize);
+		return;
+	}
+
+	in = vis + ofs;
+	end = vis + vissize;
+	out = row;
+	while (out < row + rowsize && in < end) {
+		if (*in) {
+			*out++ = *in++;
+			continue;
+		}
+
+		/* 0, count: a run of zero bytes */
+		count = (in + 1 < end) ? in[1] : 0;
+		in = in + 2;
+		if (count > row + rowsize - out)
+			count = row + rowsize - out;
+		memset(out, 0, count);
+		out = out + count;
+	}
+	if (out < row + rowsize)
+		memset(out, 0, row + rowsize - out);
+
+	return;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Mark the entries of a "0,2,5-7" style list in sel[0..num-1]. Returns the
+   number of entries selected. */
+long select_list(char *list, long num, eightbit *sel) {
+	char	*p=list;
+	long	 first, last, i, count=0;
+
+	memset(sel, 0, num);
+	while (*p != '\0') {
+		first = strtol(p, &p, 10);
+		last = first;
+		if (*p == '-')
+			last = strtol(p + 1, &p, 10);
+		for (i = (first < 0) ? 0 : first; i <= last && i < num; i++) {
+			if (!sel[i]) {
+				sel[i] = 1;
+				count++;
+			}
+		}
+		if (*p == ',')
+			p++;
+	}
+
+	return count;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Viewpoints from a file, one x,y,z (or x y z) per line, # for comments.
+   Returns how many were read, -1 if the file can't be. */
+long read_points(char *name, struct vertex_t **out) {
+	FILE		*f;
+	char		 line[256], *c;
+	struct vertex_t	 pt, *pts=NULL, *np;
+	long		 num=0, cap=0;
+
+	if ((f = fopen(name, "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#')
+			continue;
+		for (c=line; *c != '\0'; c++) {
+			if (*c == ',')
+				*c = ' ';
+		}
+		if (sscanf(line, "%f %f %f", &pt.X, &pt.Y, &pt.Z) != 3)
+			continue;
+		if (num == cap) {
+			cap = (cap > 0) ? cap * 2 : 256;
+			if ((np = realloc(pts, sizeof(struct vertex_t) * cap)) == NULL) {
+				free(pts);
+				fclose(f);
+				return -1;
+			}
+			pts = np;
+		}
+		pts[num++] = pt;
+	}
+	fclose(f);
+
+	*out = pts;
+	return num;
+}
+
+/* Keep only the faces in leaves visible (PVS) from options->viewpoint: a
+   point, the first entity of a class, or @file for a list of points. The
+   tree is decoded once however many points there are, and each leaf they
+   fall in is unpacked once. If face_seen isn't NULL it gets how many of
+   the points see each face, and *numpts how many points there were.
+   Returns non-zero on error. */
+int pick_visible(struct options_t *options, struct bspdata_t *bsp, struct dheader_t *hdr,
+                 struct plane_t *planelist, struct model_t *modellist, long nummodels,
+                 long numfaces, eightbit *face_sel, long *face_seen, long *numpts) {
+	struct node_t	*nodelist=NULL;
+	struct leaf_t	*leaflist=NULL;
+	struct entity_t	 ent;
+	struct vertex_t	 pt, *pts=&pt;
+	eightbit	*p, *vis, *marks, *row, *leaf_vis;
+	char		*ep, *eend;
+	long		 numnodes, numleafs, rowsize, leaf, i, j, k, n, x, f, num=1;
+	long		*leaf_hits, *face_mark, *seen;
+
+	numnodes = hdr->nodes.size / BSP_NODE_SIZE;
+	numleafs = hdr->leaves.size / BSP_LEAF_SIZE;
+	if (nummodels < 1 || numleafs < 1) {
+		fprintf(stderr,"error: no world model or leaves for visibility\n");
+		return 1;
+	}
+
+	/* Where from? */
+	if (options->viewpoint[0] == '@') {
+		num = read_points(&options->viewpoint[1], &pts);
+		if (num <= 0) {
+			fprintf(stderr,"error: no viewpoints read from %s\n",&options->viewpoint[1]);
+			if (num == 0)
+				free(pts);
+			return 1;
+		}
+	} else if (sscanf(options->viewpoint, "%f,%f,%f", &pt.X, &pt.Y, &pt.Z) != 3) {
+		ep = (char *)bsp->data + hdr->entities.offset;
+		eend = ep + hdr->entities.size;
+		while ((ep = next_entity(ep, eend, &ent)) != NULL) {
+			if (ent.has_origin && ent.classname_len == (long)strlen(options->viewpoint) &&
+			    strncmp(ent.classname, options->viewpoint, ent.classname_len) == 0)
+				break;
+		}
+		if (ep == NULL) {
+			fprintf(stderr,"error: no %s entity with an origin\n",options->viewpoint);
+			return 1;
+		}
+		pt = ent.origin;
+	}
+
+	nodelist = malloc(sizeof(struct node_t) * (numnodes + 1));
+	leaflist = malloc(sizeof(struct leaf_t) * (numleafs + 1));
+	leaf_vis = calloc(numleafs + 1, sizeof(eightbit));
+	leaf_hits = calloc(numleafs + 1, sizeof(long));
+	face_mark = malloc(sizeof(long) * (numfaces + 1));
+	seen = (face_seen != NULL) ? face_seen : malloc(sizeof(long) * (numfaces + 1));
+	rowsize = (modellist[0].numleafs + 7) >> 3;
+	row = malloc(rowsize + 1);
+	if (nodelist == NULL || leaflist == NULL || leaf_vis == NULL || leaf_hits == NULL ||
+	    face_mark == NULL || seen == NULL || row == NULL) {
+		fprintf(stderr,"Error allocating visibility info.\n");
+		x = 2;
+		goto done;
 	}
 
-	stdprintf("  Z direction: %d [%s]\n",opt->z_direction,dirstr);
-	if (opt->z_pad == 0) {
-		stdprintf("    Warning: direction option has no effect with Z scale set to 0.\n");
+	p = bsp->data + hdr->nodes.offset;
+	for (i=0; i<numnodes; i++, p+=BSP_NODE_SIZE) {
+		nodelist[i].plane_id = get_long(p);
+		nodelist[i].front    = (short)get_short(p + 4);
+		nodelist[i].back     = (short)get_short(p + 6);
+		for (j=0; j<3; j++) {
+			nodelist[i].bound_min[j] = (short)get_short(p + 8 + j*2);
+			nodelist[i].bound_max[j] = (short)get_short(p + 14 + j*2);
+		}
+		nodelist[i].face_id  = get_short(p + 20);
+		nodelist[i].face_num = get_short(p + 22);
 	}
 
-	/* Camera axis */
-	switch (opt->camera_axis) {
-		case 1:
-			sprintf(dirstr,"+X");
-			break;
-		case -1:
-			sprintf(dirstr,"-X");
-			break;
-		case 2:
-			sprintf(dirstr,"+Y");
-			break;
-		case -2:
-			sprintf(dirstr,"-Y");
-			break;
-		case 3:
-			sprintf(dirstr,"+Z");
-			break;
-		case -3:
-			sprintf(dirstr,"-Z");
-			break;
-		default:
-			sprintf(dirstr,"unknown!");
-			break;
+	p = bsp->data + hdr->leaves.offset;
+	for (i=0; i<numleafs; i++, p+=BSP_LEAF_SIZE) {
+		leaflist[i].type    = get_long(p);
+		leaflist[i].vislist = get_long(p + 4);
+		for (j=0; j<3; j++) {
+			leaflist[i].bound_min[j] = (short)get_short(p + 8 + j*2);
+			leaflist[i].bound_max[j] = (short)get_short(p + 14 + j*2);
+		}
+		leaflist[i].lface_id  = get_short(p + 20);
+		leaflist[i].lface_num = get_short(p + 22);
+		leaflist[i].sndwater  = p[24];
+		leaflist[i].sndsky    = p[25];
+		leaflist[i].sndslime  = p[26];
+		leaflist[i].sndlava   = p[27];
 	}
 
-	stdprintf("  Camera axis: %s\n", dirstr);
-	stdprintf("  Remove extraneous edges: %s\n", (opt->edgeremove == 1) ? "yes" : "no");
-	stdprintf("  Edge removal dot product theshold: %f\n", opt->flat_threshold);
-	stdprintf("  Minimum polygon area threshold (approximate): %d\n", opt->area_threshold);
-	stdprintf("  Minimum line length threshold: %d\n", opt->linelen_threshold);
-	stdprintf("  Creating %s image.\n", (opt->negative_image == 1) ? "negative" : "positive");
+	/* Which leaf each point is in; points sharing a leaf see the same */
+	for (n=0; n<num; n++) {
+		leaf = find_leaf(nodelist, numnodes, planelist, modellist[0].node_id[0], &pts[n]);
+		if (leaf >= numleafs)
+			leaf = 0;
+		leaf_hits[leaf]++;
+	}
+	if (num == 1) {
+		stdprintf("Viewpoint (%.0f %.0f %.0f) is in leaf %ld", pts[0].X, pts[0].Y, pts[0].Z, leaf);
+		if (leaf == 0)
+			stdprintf(" (solid!)");
+	} else {
+		for (i=0, k=0; i<numleafs; i++)
+			k += (leaf_hits[i] > 0);
+		stdprintf("%ld viewpoints are in %ld leaves", num, k);
+		if (leaf_hits[0] > 0)
+			stdprintf(" (%ld in solid!)", leaf_hits[0]);
+	}
 
-	stdprintf("\n");
-	stdprintf("  Input (bsp) file: %s\n",opt->bspf_name);
-	if(opt->write_raw)
-		stdprintf("  Output (raw) file: %s\n\n",opt->outf_name);
-	else
-		stdprintf("  Output (%s bmp) file: %s\n\n",opt->write_nocomp ? "uncompressed" : "RLE compressed" ,opt->outf_name);
+	/* Visible leaves' faces, through the face list lump; a face is counted
+	   once for each point that sees it, however many leaves it is in */
+	vis = bsp->data + hdr->visilist.offset;
+	marks = bsp->data + hdr->iface.offset;
+	memset(seen, 0, sizeof(long) * numfaces);
+	for (i=0; i<numfaces; i++)
+		face_mark[i] = -1;
+	for (leaf=0; leaf<numleafs; leaf++) {
+		if (leaf_hits[leaf] == 0)
+			continue;
+		decompress_vis(vis, hdr->visilist.size, leaflist[leaf].vislist, row, rowsize);
+		for (i=1; i<numleafs; i++) {
+			/* the viewpoint's own leaf is always visible */
+			if (i != leaf && (i - 1 >= rowsize * 8 || !(row[(i-1) >> 3] & (1 << ((i-1) & 7)))))
+				continue;
+			leaf_vis[i] = 1;
+			for (j=leaflist[i].lface_id; j<leaflist[i].lface_id + leaflist[i].lface_num; j++) {
+				f = get_short(marks + j*BSP_MARK_SIZE);
+				if (face_mark[f] != leaf) {
+					face_mark[f] = leaf;
+					seen[f] += leaf_hits[leaf];
+				}
+			}
+		}
+	}
 
-	return;
+	for (i=1, k=0; i<numleafs; i++)
+		k += leaf_vis[i];
+	x = 0;
+	for (i=0; i<numfaces; i++) {
+		face_sel[i] = face_sel[i] && seen[i] > 0;
+		if (face_sel[i])
+			x++;
+	}
+	stdprintf(", sees %ld of %ld leaves, %ld faces.\n", k, numleafs - 1, x);
+	if (numpts != NULL)
+		*numpts = num;
+	x = 0;
+
+done:
+	if (pts != &pt)
+		free(pts);
+	free(nodelist);
+	free(leaflist);
+	free(leaf_vis);
+	free(leaf_hits);
+	free(face_mark);
+	if (seen != face_seen)
+		free(seen);
+	free(row);
+	return (int)x;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* A lump has to lie inside the file and hold whole records */
+int check_lump(char *what, struct dentry_t *lump, long filesize, long recsize) {
+	if (lump->offset < 0 || lump->size < 0 || lump->offset > filesize || lump->size > filesize - lump->offset) {
+		fprintf(stderr,"error: %s at %ld, %ld bytes, past end of file (%ld bytes)\n",what,lump->offset,lump->size,filesize);
+		return 1;
+	}
+	if (recsize > 1 && lump->size % recsize != 0) {
+		fprintf(stderr,"error: %s size %ld is not a multiple of %ld\n",what,lump->size,recsize);
+		return 1;
+	}
+	return 0;
+}
+
+/* One pass over the lumps, straight from the file image, checking every
+   index the rest of the program follows. Each check first finds the
+   largest index in a tight loop, and only goes looking for the culprit
+   to report if that is out of range. After this the readers and drawing
+   loops don't need to check anything. */
+int validate_bsp(struct bspdata_t *bsp, struct dheader_t *hdr) {
+	eightbit	*base=bsp->data, *p;
+	long		 numvertices, numedges, numlistedges, numfaces, nummodels, numplanes;
+	long		 numtexinfo, numnodes, numleafs, nummarks, numtextures;
+	long		 i, j, k, n, m;
+	int64_t		 big;
+
+	if (hdr->version != 29)
+		stdprintf("Warning: bsp version %ld, expected 29.\n",hdr->version);
+
+	if (check_lump("entities",     &hdr->entities,  bsp->size, 1) ||
+	    check_lump("planes",       &hdr->planes,    bsp->size, BSP_PLANE_SIZE) ||
+	    check_lump("miptex",       &hdr->miptex,    bsp->size, 1) ||
+	    check_lump("vertices",     &hdr->vertices,  bsp->size, BSP_VERTEX_SIZE) ||
+	    check_lump("visibility",   &hdr->visilist,  bsp->size, 1) ||
+	    check_lump("nodes",        &hdr->nodes,     bsp->size, BSP_NODE_SIZE) ||
+	    check_lump("texinfo",      &hdr->texinfo,   bsp->size, BSP_TEXINFO_SIZE) ||
+	    check_lump("faces",        &hdr->faces,     bsp->size, BSP_FACE_SIZE) ||
+	    check_lump("lightmaps",    &hdr->lightmaps, bsp->size, 1) ||
+	    check_lump("clipnodes",    &hdr->clipnodes, bsp->size, 1) ||
+	    check_lump("leaves",       &hdr->leaves,    bsp->size, BSP_LEAF_SIZE) ||
+	    check_lump("marksurfaces", &hdr->iface,     bsp->size, BSP_MARK_SIZE) ||
+	    check_lump("edges",        &hdr->edges,     bsp->size, BSP_EDGE_SIZE) ||
+	    check_lump("ledges",       &hdr->ledges,    bsp->size, BSP_LEDGE_SIZE) ||
+	    check_lump("models",       &hdr->models,    bsp->size, BSP_MODEL_SIZE))
+		return 1;
+
+	numvertices  = hdr->vertices.size / BSP_VERTEX_SIZE;
+	numedges     = hdr->edges.size / BSP_EDGE_SIZE;
+	numlistedges = hdr->ledges.size / BSP_LEDGE_SIZE;
+	numfaces     = hdr->faces.size / BSP_FACE_SIZE;
+	nummodels    = hdr->models.size / BSP_MODEL_SIZE;
+	numplanes    = hdr->planes.size / BSP_PLANE_SIZE;
+	numtexinfo   = hdr->texinfo.size / BSP_TEXINFO_SIZE;
+	numnodes     = hdr->nodes.size / BSP_NODE_SIZE;
+	numleafs     = hdr->leaves.size / BSP_LEAF_SIZE;
+	nummarks     = hdr->iface.size / BSP_MARK_SIZE;
+
+	/* texture directory: a count, then that many offsets */
+	p = base + hdr->miptex.offset;
+	numtextures = (hdr->miptex.size >= 4) ? get_long(p) : 0;
+	if (numtextures < 0 || numtextures > (hdr->miptex.size - 4) / 4) {
+		fprintf(stderr,"error: miptex claims %ld textures in %ld bytes\n",numtextures,hdr->miptex.size);
+		return 1;
+	}
+
+	/* vertices: real numbers, near enough to size an image from */
+	p = base + hdr->vertices.offset;
+	for (i=0; i<numvertices * 3; i++) {
+		if (!(fabs(get_float(p + i*4)) <= MAX_COORD)) {
+			fprintf(stderr,"error: vertex %ld is at %g on axis %ld\n",i/3,get_float(p + i*4),i%3);
+			return 1;
+		}
+	}
+
+	/* planes: one of the six axis types */
+	p = base + hdr->planes.offset;
+	for (i=0; i<numplanes; i++, p+=BSP_PLANE_SIZE) {
+		j = get_long(p + 16);
+		if (j < 0 || j > 5) {
+			fprintf(stderr,"error: plane %ld has type %ld\n",i,j);
+			return 1;
+		}
+	}
+
+	/* edges -> vertices */
+	p = base + hdr->edges.offset;
+	for (i=0, m=0; i<numedges * 2; i++) {
+		n = get_short(p + i*2);
+		m = (n > m) ? n : m;
+	}
+	if (numedges > 0 && m >= numvertices) {
+		for (i=0; i<numedges * 2 && get_short(p + i*2) < numvertices; i++)
+			;
+		fprintf(stderr,"error: edge %ld uses vertex %d, there are %ld\n",i/2,get_short(p + i*2),numvertices);
+		return 1;
+	}
+
+	/* ledges -> edges, either way round (sizes in 64 bits, where a 32-bit
+	   long can't hold -INT32_MIN) */
+	p = base + hdr->ledges.offset;
+	for (i=0, big=0; i<numlistedges; i++) {
+		n = get_long(p + i*4);
+		big = (llabs((int64_t)n) > big) ? llabs((int64_t)n) : big;
+	}
+	if (numlistedges > 0 && big >= numedges) {
+		for (i=0; i<numlistedges && llabs((int64_t)get_long(p + i*4)) < numedges; i++)
+			;
+		fprintf(stderr,"error: ledge %ld uses edge %ld, there are %ld\n",i,get_long(p + i*4),numedges);
+		return 1;
+	}
+
+	/* faces -> planes, ledges, texinfo */
+	p = base + hdr->faces.offset;
+	for (i=0; i<numfaces; i++, p+=BSP_FACE_SIZE) {
+		j = get_long(p + 4);
+		k = get_short(p + 8);
+		if (get_short(p) >= numplanes) {
+			fprintf(stderr,"error: face %ld uses plane %d, there are %ld\n",i,get_short(p),numplanes);
+			return 1;
+		}
+		if (j < 0 || j > numlistedges - k) {
+			fprintf(stderr,"error: face %ld uses ledges %ld..%ld, there are %ld\n",i,j,j+k-1,numlistedges);
+			return 1;
+		}
+		if (get_short(p + 10) >= numtexinfo) {
+			fprintf(stderr,"error: face %ld uses texinfo %d, there are %ld\n",i,get_short(p + 10),numtexinfo);
+			return 1;
+		}
+	}
+
+	/* texinfo -> textures */
+	p = base + hdr->texinfo.offset;
+	for (i=0; i<numtexinfo; i++, p+=BSP_TEXINFO_SIZE) {
+		j = get_long(p + 32);
+		if (j < 0 || j >= numtextures) {
+			fprintf(stderr,"error: texinfo %ld uses texture %ld, there are %ld\n",i,j,numtextures);
+			return 1;
+		}
+	}
+
+	/* models -> faces, nodes, leaves */
+	p = base + hdr->models.offset;
+	for (i=0; i<nummodels; i++, p+=BSP_MODEL_SIZE) {
+		j = get_long(p + 56);
+		k = get_long(p + 60);
+		if (j < 0 || k < 0 || j > numfaces - k) {
+			fprintf(stderr,"error: model %ld uses faces %ld..%ld, there are %ld\n",i,j,j+k-1,numfaces);
+			return 1;
+		}
+		j = get_long(p + 36);
+		if (numnodes > 0 && (j < 0 || j >= numnodes)) {
+			fprintf(stderr,"error: model %ld starts at node %ld, there are %ld\n",i,j,numnodes);
+			return 1;
+		}
+		j = get_long(p + 52);
+		if (j < 0 || j > numleafs) {
+			fprintf(stderr,"error: model %ld has %ld leaves, there are %ld\n",i,j,numleafs);
+			return 1;
+		}
+	}
+
+	/* nodes -> planes, nodes or leaves */
+	p = base + hdr->nodes.offset;
+	for (i=0; i<numnodes; i++, p+=BSP_NODE_SIZE) {
+		j = get_long(p);
+		if (j < 0 || j >= numplanes) {
+			fprintf(stderr,"error: node %ld uses plane %ld, there are %ld\n",i,j,numplanes);
+			return 1;
+		}
+		for (k=0; k<2; k++) {
+			j = (short)get_short(p + 4 + k*2);
+			if ((j >= 0 && j >= numnodes) || (j < 0 && -(j+1) >= numleafs)) {
+				fprintf(stderr,"error: node %ld has child %ld, there are %ld nodes and %ld leaves\n",i,j,numnodes,numleafs);
+				return 1;
+			}
+		}
+	}
+
+	/* leaves -> marksurfaces, visibility */
+	p = base + hdr->leaves.offset;
+	for (i=0; i<numleafs; i++, p+=BSP_LEAF_SIZE) {
+		j = get_short(p + 20);
+		k = get_short(p + 22);
+		if (j + k > nummarks) {
+			fprintf(stderr,"error: leaf %ld uses marksurfaces %ld..%ld, there are %ld\n",i,j,j+k-1,nummarks);
+			return 1;
+		}
+		j = get_long(p + 4);
+		if (j >= hdr->visilist.size) {
+			fprintf(stderr,"error: leaf %ld has visibility at %ld, lump is %ld bytes\n",i,j,hdr->visilist.size);
+			return 1;
+		}
+	}
+
+	/* marksurfaces -> faces */
+	p = base + hdr->iface.offset;
+	for (i=0, m=0; i<nummarks; i++) {
+		n = get_short(p + i*2);
+		m = (n > m) ? n : m;
+	}
+	if (nummarks > 0 && m >= numfaces) {
+		for (i=0; i<nummarks && get_short(p + i*2) < numfaces; i++)
+			;
+		fprintf(stderr,"error: marksurface %ld uses face %d, there are %ld\n",i,get_short(p + i*2),numfaces);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* A coordinate on the diff grid; way off the map (or not a number) it
+   only has to come out the same both times */
+int32_t grid_coord(float v) {
+	if (!(v > -1e9 && v < 1e9))
+		return (v < 0.0) ? INT32_MIN : INT32_MAX;
+	return (int32_t)floor(v / DIFF_GRID + 0.5);
+}
+
+void edge_key(struct vertex_t *a, struct vertex_t *b, struct edgekey_t *key) {
+	int32_t	 q[3];
+	int	 i;
+
+	key->p[0] = grid_coord(a->X);  key->p[1] = grid_coord(a->Y);  key->p[2] = grid_coord(a->Z);
+	key->p[3] = grid_coord(b->X);  key->p[4] = grid_coord(b->Y);  key->p[5] = grid_coord(b->Z);
+	for (i=0; i<3 && key->p[i] == key->p[i+3]; i++)
+		;
+	if (i < 3 && key->p[i] > key->p[i+3]) {
+		memcpy(q, &key->p[0], sizeof(q));
+		memcpy(&key->p[0], &key->p[3], sizeof(q));
+		memcpy(&key->p[3], q, sizeof(q));
+	}
+}
+
+uint32_t hash_key(struct edgekey_t *key) {
+	uint32_t h = 2166136261u;
+	int	 i;
+
+	/* map coordinates are mostly multiples of 8 or 16, so the high bits
+	   of each step are folded back down */
+	for (i=0; i<6; i++) {
+		h = (h ^ (uint32_t)key->p[i]) * 0x9e3779b1u;
+		h ^= h >> 15;
+	}
+	h *= 0x85ebca6bu;
+	return h ^ (h >> 13);
+}
+
+/* Room for num keys, the table no more than half full. Returns 0, or 1
+   if out of memory. */
+int edgeset_make(struct edgeset_t *set, long num) {
+	unsigned long	size = 16;
+
+	while (size < (unsigned long)num * 2)
+		size <<= 1;
+	set->mask = size - 1;
+	set->keys = malloc(sizeof(struct edgekey_t) * size);
+	set->used = calloc(size, 1);
+	return (set->keys == NULL || set->used == NULL);
+}
+
+void edgeset_free(struct edgeset_t *set) {
+	free(set->keys);
+	free(set->used);
+	set->keys = NULL;
+	set->used = NULL;
+}
+
+/* The slot holding key, or the empty one it would go in */
+unsigned long edgeset_find(struct edgeset_t *set, struct edgekey_t *key) {
+	unsigned long	i = hash_key(key) & set->mask;
+
+	while (set->used[i] && memcmp(&set->keys[i], key, sizeof(struct edgekey_t)) != 0)
+		i = (i + 1) & set->mask;
+	return i;
+}
+
+/* Returns 1 if key wasn't there before */
+int edgeset_add(struct edgeset_t *set, struct edgekey_t *key) {
+	unsigned long	i = edgeset_find(set, key);
+
+	if (set->used[i])
+		return 0;
+	set->used[i] = 1;
+	set->keys[i] = *key;
+	return 1;
+}
+
+int edgeset_has(struct edgeset_t *set, struct edgekey_t *key) {
+	return set->used[edgeset_find(set, key)];
+}
+
+/* -D: compare the edges of the faces of both maps, the new one's through
+   its ledges, whatever of it is picked to be drawn. Each listed edge gets
+   DIFF_SAME or DIFF_ADDED in (*diff)[edge]; old edges that are gone are
+   put on the end of the vertex, edge and draw lists as DIFF_REMOVED.
+   Each map goes into a hash set once and is looked up in the other once,
+   so this stays linear however many edges there are. *list is made if
+   NULL. Returns 0, 1 if the old map is no good, 2 if out of memory. */
+int diff_maps(char *name, struct vertex_t **vlist, long *numverts, struct edge_t **elist, long *numedges,
+              int *ledges, long numledges, long **list, long *num, eightbit **diff) {
+	struct bspdata_t	 old;
+	struct dheader_t	 hdr;
+	struct edgeset_t	 now = { NULL, NULL, 0 }, was = { NULL, NULL, 0 };
+	struct edgekey_t	 key;
+	struct vertex_t		 a, b, *nv;
+	struct edge_t		*ne;
+	eightbit		*d=NULL, *ep, *vp;
+	uint32_t		*seen=NULL;
+	long			*gone=NULL, *vmap=NULL, *nl;
+	long			 oldverts, oldedges, oldledges, numgone=0, added=0, newverts=0, i, j, k, n;
+	int			 ret=2;
+
+	if (open_bsp(name, &old)) {
+		fprintf(stderr,"Error opening bsp file %s to compare with.\n",name);
+		return 1;
+	}
+	if (old.size < BSP_HEADER_SIZE) {
+		fprintf(stderr,"error: %s is only %ld bytes!\n",name,old.size);
+		close_bsp(&old);
+		return 1;
+	}
+	get_header(&hdr, old.data);
+	if (validate_bsp(&old, &hdr)) {
+		fprintf(stderr,"%s is damaged, not comparing with it.\n",name);
+		close_bsp(&old);
+		return 1;
+	}
+	oldverts = hdr.vertices.size / BSP_VERTEX_SIZE;
+	oldedges = hdr.edges.size / BSP_EDGE_SIZE;
+	oldledges = hdr.ledges.size / BSP_LEDGE_SIZE;
+	vp = old.data + hdr.vertices.offset;
+
+	if (*list == NULL) {
+		if ((*list = malloc(sizeof(long) * (*numedges + 1))) == NULL)
+			goto done;
+		for (n=0; n<*numedges; n++)
+			(*list)[n] = n;
+		*num = *numedges;
+	}
+
+	seen = calloc((oldedges + 31) / 32 + 1, sizeof(uint32_t));
+	gone = malloc(sizeof(long) * (oldedges + 1));
+	vmap = malloc(sizeof(long) * (oldverts + 1));
+	if (seen == NULL || gone == NULL || vmap == NULL || edgeset_make(&now, numledges) || edgeset_make(&was, oldedges))
+		goto done;
+
+	/* the map as it is, all of it: an edge left out of the picture is
+	   not gone */
+	for (j=0; j<numledges; j++) {
+		i = labs(ledges[j]);
+		edge_key(&(*vlist)[(*elist)[i].vertex0], &(*vlist)[(*elist)[i].vertex1], &key);
+		edgeset_add(&now, &key);
+	}
+
+	/* the map as it was, each edge once; the ones not there now are gone */
+	for (j=0; j<oldledges; j++) {
+		k = labs(get_long(old.data + hdr.ledges.offset + j * BSP_LEDGE_SIZE));
+		if (seen[k >> 5] & (1u << (k & 31)))
+			continue;
+		seen[k >> 5] |= (1u << (k & 31));
+		ep = old.data + hdr.edges.offset + k * BSP_EDGE_SIZE;
+		get_vertex(&a, vp + get_short(ep) * BSP_VERTEX_SIZE);
+		get_vertex(&b, vp + get_short(ep + 2) * BSP_VERTEX_SIZE);
+		edge_key(&a, &b, &key);
+		if (edgeset_add(&was, &key) && !edgeset_has(&now, &key))
+			gone[numgone++] = k;
+	}
+
+	/* what is listed now was either there before or is new; edges with
+	   both ends on the same grid point can't tell, and count as the same */
+	if ((d = malloc(*numedges + numgone + 1)) == NULL)
+		goto done;
+	memset(d, DIFF_SAME, *numedges + numgone + 1);
+	for (n=0; n<*num; n++) {
+		i = (*list)[n];
+		edge_key(&(*vlist)[(*elist)[i].vertex0], &(*vlist)[(*elist)[i].vertex1], &key);
+		if (memcmp(&key.p[0], &key.p[3], sizeof(int32_t) * 3) != 0 && !edgeset_has(&was, &key)) {
+			d[i] = DIFF_ADDED;
+			added++;
+		}
+	}
+
+	/* the old vertices the removed edges need, each once */
+	for (i=0; i<oldverts; i++)
+		vmap[i] = -1;
+	for (n=0; n<numgone; n++) {
+		ep = old.data + hdr.edges.offset + gone[n] * BSP_EDGE_SIZE;
+		for (j=0; j<2; j++) {
+			k = get_short(ep + j * 2);
+			if (vmap[k] < 0)
+				vmap[k] = newverts++;
+		}
+	}
+	nv = realloc(*vlist, sizeof(struct vertex_t) * (*numverts + newverts + 1));
+	if (nv == NULL)
+		goto done;
+	*vlist = nv;
+	ne = realloc(*elist, sizeof(struct edge_t) * (*numedges + numgone + 1));
+	if (ne == NULL)
+		goto done;
+	*elist = ne;
+	nl = realloc(*list, sizeof(long) * (*num + numgone + 1));
+	if (nl == NULL)
+		goto done;
+	*list = nl;
+
+	for (i=0; i<oldverts && newverts > 0; i++) {
+		if (vmap[i] >= 0)
+			get_vertex(&nv[*numverts + vmap[i]], vp + i * BSP_VERTEX_SIZE);
+	}
+	for (n=0; n<numgone; n++) {
+		ep = old.data + hdr.edges.offset + gone[n] * BSP_EDGE_SIZE;
+		ne[*numedges + n].vertex0 = (uint32_t)(*numverts + vmap[get_short(ep)]);
+		ne[*numedges + n].vertex1 = (uint32_t)(*numverts + vmap[get_short(ep + 2)]);
+		nl[*num + n] = *numedges + n;
+		d[*numedges + n] = DIFF_REMOVED;
+	}
+	stdprintf("Compared with %s: %ld edges unchanged, %ld added, %ld removed.\n",name,*num - added,added,numgone);
+
+	*numverts += newverts;
+	*numedges += numgone;
+	*num += numgone;
+	*diff = d;
+	d = NULL;
+	ret = 0;
+
+done:
+	if (ret == 2)
+		fprintf(stderr,"Error allocating map diff.\n");
+	free(d);
+	free(seen);
+	free(gone);
+	free(vmap);
+	edgeset_free(&now);
+	edgeset_free(&was);
+	close_bsp(&old);
+	return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* -L: the layers (a bit each) something spanning zmin..zmax is drawn in,
+   between bound[0] .. bound[num]. Anything tall goes in each layer it
+   reaches into, anything level in the one it lies in, the bottom of
+   each layer in and its top out (but for the top layer). */
+uint32_t layer_mask(float zmin, float zmax, float *bound, int num) {
+	uint32_t	 m = 0;
+	int		 k;
+
+	for (k=0; k<num; k++) {
+		if (zmax > zmin) {
+			if (zmin < bound[k+1] && zmax > bound[k])
+				m |= (1u << k);
+		} else if (zmin >= bound[k] && (zmin < bound[k+1] || (k == num - 1 && zmin <= bound[k+1]))) {
+			m |= (1u << k);
+		}
+	}
+	return m;
 }
 
 /*===========================================================================*/
 
-int main(int argc, char *argv[]) {
-	FILE                 *bspfile=NULL;
+int render_bsp(struct options_t *opt, struct bspdata_t *bsp) {
 	FILE                 *outfile=NULL;
 	long                  i=0, j=0, k=0, x=0;
 	long                  pad=0x00000000;
 	struct dheader_t      bsp_header;
+	eightbit             *p;
 
 	struct vertex_t      *vertexlist=NULL;
 	struct edge_t        *edgelist=NULL;
 	struct face_t        *facelist=NULL;
 	int                  *ledges=NULL;
+	struct model_t       *modellist=NULL;
+
+	/* model selection */
+	struct plane_t       *planelist=NULL;
+	struct texinfo_t     *texinfolist=NULL;
+	char                (*texnames)[MIPTEX_NAME + 1]=NULL;
+
+	/* face-driven selection */
+	eightbit             *model_sel=NULL;
+	eightbit             *face_sel=NULL;
+	uint32_t             *edge_seen=NULL; /* bitset, edge already listed */
+	long                 *drawlist=NULL;  /* edges to draw, NULL for all */
+	eightbit             *tex_drop=NULL;
+	long                  numdraw=0, n=0;
 
 	/* edge removal stuff */
 	struct edge_extra_t  *edge_extra=NULL;
@@ -599,16 +3778,83 @@ int main(int argc, char *argv[]) {
 	long                  numlistedges=0;
 	long                  numvertices=0;
 	long                  numfaces=0;
+	long                  nummodels=0;
+	long                  numplanes=0;
+	long                  numtexinfo=0;
+	long                  numtextures=0;
 
 	float                 minX=0.0, maxX=0.0, minY=0.0, maxY=0.0, minZ=0.0, maxZ=0.0, midZ=0.0, tempf=0.0;
-	long                  Zoffset0=0, Zoffset1=0;
+	double                t0=0.0, t1=0.0;
+	long                  Zoffset0=0;
 	long                  Z_Xdir=1, Z_Ydir=-1;
 
 	long                  imagewidth=0,imageheight=0;
 
-	eightbit             *image;
+	eightbit             *image=NULL;
+	float                *zbuf=NULL;
+	uint16_t             *zmap=NULL;
+	float                *facex=NULL, *facey=NULL, *facez=NULL;
+	struct vertex_t       eye;
+	struct canvas_t       canvas;
+	eightbit             *rowbuf=NULL;
+	eightbit              lut[256];
+
+	/* vector output */
+	struct segment_t     *seg=NULL;
+	long                  numseg=0, numchains=0, *pts=NULL, *start=NULL;
+	float                *sx=NULL, *sy=NULL;
+	struct spoint_t      *spt=NULL, *sp0, *sp1;
+
+	/* edge test */
+	float                *ed_flat=NULL, *ed_len2=NULL;
+	int                  *ed_area=NULL;
+	long                 *keep=NULL, numkeep=0, counts[3];
+	unsigned int         *chain_col=NULL;
+	uint32_t             *vert_done=NULL;  /* layers each vertex is drawn in */
+
+	/* free camera */
+	struct camera_t       cam;
+	char                 *vflag=NULL;  /* 1 behind the eye, 2 cut at the near plane */
+	int                   clip_lines=0;
+
+	/* turntable */
+	long                  frame=0, numverts0=0, numdraw0=0;
+	struct vertex_t      *world=NULL;
+	struct edge_t        *edges0=NULL;
+	long                 *draw0=NULL;
+	long                  width0=0, height0=0;
+	void                (*frames_hook)(char *stage, long done, long total)=NULL;
+
+	/* map diff */
+	eightbit             *edge_diff=NULL;  /* DIFF_ per edge */
+
+	/* floor plan */
+	struct floor_t       *floors=NULL;
+	long                  numfloors=0;
+
+	/* layers */
+	int                   numlayers=1, l, layer_at=0;
+	float                 bound[MAX_LAYERS + 1];
+	uint32_t             *edge_lay=NULL, *face_lay=NULL, *chain_lay=NULL, lay;
+	struct canvas_t       layer[MAX_LAYERS], *cv;
+	char                 *outname0=NULL, layer_out[MAX_NAME + 16];
+
+	/* region */
+	struct vertex_t       corner[2];
+	long                  org_x=0, org_y=0;
+	float                 tempf2=0.0, fx0, fy0, fz0, fx1, fy1, fz1;
+	int                   bpp=1;
+
+	/* coloring */
+	long                 *edge_face=NULL, *face_model=NULL;
+	long                 *face_seen=NULL, numviews=0;  /* -kv: points seeing each face */
+	float                 zlo=0.0, zhi=0.0, level=0.0;
+	unsigned int          color=0;
+	struct entity_t       ent;
+	char                 *entp, *entend;
 	struct options_t      options;
 	int                   drawcol;
+	int                   ret=0;   /* past the first allocation, errors go through cleanup */
 
 	static struct bmp_fileheader_t  bmpfileheader;
 	static struct bmp_infoheader_t  bmpinfoheader;
@@ -616,96 +3862,36 @@ int main(int argc, char *argv[]) {
 
 	/*****/
 
-
-	/* Enough args? */
-	if (argc < 2) {
-		show_help();
-		return 1;
-	}
-
-	/* Setup options */
-	def_options(&options);
-	get_options(&options,argc,argv);
-	show_options(&options);
-    /* Create Output file name if it is not provided */
-    if(options.outf_name ==  NULL)
-    {
-        options.outf_name=malloc(strlen(options.bspf_name)+1);
-        strncpy (options.outf_name, options.bspf_name,strlen(options.bspf_name)-3);
-        strcat(options.outf_name,"bmp");
-        fprintf(stdout,"Assuming BMP name from BSP name: %s\n",options.outf_name);
-    }
-
-	bspfile=fopen(options.bspf_name,"rb");
-	if (bspfile == NULL) {
-		fprintf(stderr,"Error opening bsp file %s.\n",options.bspf_name);
-		return 1;
-	}
+	/* Work on a copy, auto z_pad is worked out per map */
+	memcpy(&options, opt, sizeof(struct options_t));
 
 	/* Read header */
+	t0 = timer();
 	stdprintf("Reading header...");
-	/* OLD:
-	i = fread(&bsp_header, sizeof(struct dheader_t), 1, bspfile);
-	*/
-	i = 0;
-	i = i + fread(&bsp_header.version, sizeof(long), 1, bspfile);
-	/* entities: */
-	i = i + fread(&bsp_header.entities.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.entities.size, sizeof(long), 1, bspfile);
-	/* planes: */
-	i = i + fread(&bsp_header.planes.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.planes.size, sizeof(long), 1, bspfile);
-	/* miptex: */
-	i = i + fread(&bsp_header.miptex.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.miptex.size, sizeof(long), 1, bspfile);
-	/* vertices: */
-	i = i + fread(&bsp_header.vertices.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.vertices.size, sizeof(long), 1, bspfile);
-	/* visilist: */
-	i = i + fread(&bsp_header.visilist.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.visilist.size, sizeof(long), 1, bspfile);
-	/* nodes: */
-	i = i + fread(&bsp_header.nodes.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.nodes.size, sizeof(long), 1, bspfile);
-	/* texinfo: */
-	i = i + fread(&bsp_header.texinfo.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.texinfo.size, sizeof(long), 1, bspfile);
-	/* faces: */
-	i = i + fread(&bsp_header.faces.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.faces.size, sizeof(long), 1, bspfile);
-	/* lightmaps: */
-	i = i + fread(&bsp_header.lightmaps.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.lightmaps.size, sizeof(long), 1, bspfile);
-	/* clipnodes: */
-	i = i + fread(&bsp_header.clipnodes.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.clipnodes.size, sizeof(long), 1, bspfile);
-	/* leaves: */
-	i = i + fread(&bsp_header.leaves.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.leaves.size, sizeof(long), 1, bspfile);
-	/* iface: */
-	i = i + fread(&bsp_header.iface.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.iface.size, sizeof(long), 1, bspfile);
-	/* edges: */
-	i = i + fread(&bsp_header.edges.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.edges.size, sizeof(long), 1, bspfile);
-	/* ledges: */
-	i = i + fread(&bsp_header.ledges.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.ledges.size, sizeof(long), 1, bspfile);
-	/* models: */
-	i = i + fread(&bsp_header.models.offset, sizeof(long), 1, bspfile);
-	i = i + fread(&bsp_header.models.size, sizeof(long), 1, bspfile);
-
-	if (i != 31) {
-		stdprintf("error %s!\n",strerror(errno));
+	if (bsp->size < BSP_HEADER_SIZE) {
+		fprintf(stderr,"error: %s is only %ld bytes!\n",bsp->name,bsp->size);
 		return 1;
-	} else {
-		stdprintf("done.\n");
 	}
+	get_header(&bsp_header, bsp->data);
+	stdprintf("done.\n");
 
-	numvertices = (bsp_header.vertices.size/sizeof(struct vertex_t));
-	numedges = (bsp_header.edges.size/sizeof(struct edge_t));
-	numlistedges = (bsp_header.ledges.size/sizeof(short));
-	numfaces = (bsp_header.faces.size/sizeof(struct face_t));
+	/* Everything the rest of this trusts */
+	stdprintf("Checking lumps...");
+	if (validate_bsp(bsp, &bsp_header)) {
+		fprintf(stderr,"%s%s%s is damaged, not rendering it.\n",bsp->name,(bsp->entry[0] != '\0') ? ":" : "",bsp->entry);
+		return 1;
+	}
+	stdprintf("ok.\n");
+	stats.stage[STAGE_VALIDATE] += timer() - t0;
+	t0 = timer();
+
+	numvertices = (bsp_header.vertices.size/BSP_VERTEX_SIZE);
+	numedges = (bsp_header.edges.size/BSP_EDGE_SIZE);
+	numlistedges = (bsp_header.ledges.size/BSP_LEDGE_SIZE);
+	numfaces = (bsp_header.faces.size/BSP_FACE_SIZE);
+	nummodels = (bsp_header.models.size/BSP_MODEL_SIZE);
+	numplanes = (bsp_header.planes.size/BSP_PLANE_SIZE);
+	numtexinfo = (bsp_header.texinfo.size/BSP_TEXINFO_SIZE);
 
 	/* display header */
 	stdprintf("Header info:\n\n");
@@ -730,138 +3916,307 @@ int main(int argc, char *argv[]) {
 	stdprintf(" [numfaces = %ld]\n", numfaces);
 	stdprintf("\n");
 
+	stdprintf("   models - offset %ld\n",bsp_header.models.offset);
+	stdprintf("          - size %ld",bsp_header.models.size);
+	stdprintf(" [nummodels = %ld]\n", nummodels);
+	stdprintf("\n");
+
 	/* Read vertices -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
 	vertexlist = malloc(sizeof(struct vertex_t) * numvertices);
 	if (vertexlist == NULL) {
-		fprintf(stderr,"Error allocating %ld bytes for vertices.",sizeof(struct vertex_t) * numvertices);
-		return 2;
+		fprintf(stderr,"Error allocating %ld bytes for vertices.",(long)sizeof(struct vertex_t) * numvertices);
+		ret = 2;
+		goto cleanup;
 	}
 
 	stdprintf("Reading %ld vertices...",numvertices);
-	if (fseek(bspfile,bsp_header.vertices.offset,SEEK_SET)) {
-		fprintf(stderr, "error seeking to %ld\n",bsp_header.vertices.offset);
-		return 1;
-	} else {
-		stdprintf("seek to %ld...",ftell(bspfile));
-	}
-	/* OLD:
-	i=fread(vertexlist, sizeof(struct vertex_t), numvertices, bspfile);
-	*/
-	i = 0;
-	while (i < numvertices) {
-		j = 0;
-		j = j + fread(&(vertexlist[i].X), sizeof(float), 1, bspfile);
-		j = j + fread(&(vertexlist[i].Y), sizeof(float), 1, bspfile);
-		j = j + fread(&(vertexlist[i].Z), sizeof(float), 1, bspfile);
-		if (j < 3)
-			break;
-		i++;
-	}
-	if (i != numvertices) {
-		fprintf(stderr, "error %s! only %ld read.\n",strerror(errno),i);
-		return 1;
-	} else {
-		stdprintf("successfully read %ld vertices.\n",i);
+	stdprintf("at %ld...",bsp_header.vertices.offset);
+	p = bsp->data + bsp_header.vertices.offset;
+	for (i=0; i<numvertices; i++, p+=BSP_VERTEX_SIZE) {
+		vertexlist[i].X = get_float(p);
+		vertexlist[i].Y = get_float(p + 4);
+		vertexlist[i].Z = get_float(p + 8);
 	}
+	stdprintf("successfully read %ld vertices.\n",i);
 
 	/* Read edges -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
 	edgelist = malloc(sizeof(struct edge_t) * numedges);
 	if (edgelist == NULL) {
-		fprintf(stderr,"Error allocating %ld bytes for edges.",sizeof(struct edge_t) * numedges);
-		return 2;
+		fprintf(stderr,"Error allocating %ld bytes for edges.",(long)sizeof(struct edge_t) * numedges);
+		ret = 2;
+		goto cleanup;
 	}
 
 	stdprintf( "Reading %ld edges...",numedges);
-	if (fseek(bspfile,bsp_header.edges.offset,SEEK_SET)) {
-		fprintf(stderr,"error seeking to %ld\n",bsp_header.vertices.offset);
-		return 1;
-	} else {
-		stdprintf("seek to %ld...",ftell(bspfile));
-	}
-	/* OLD:
-	i=fread(edgelist, sizeof(struct edge_t), numedges, bspfile);
-	*/
-	i = 0;
-	while (i < numedges) {
-		j = 0;
-		j = j + fread(&(edgelist[i].vertex0), sizeof(unsigned short), 1, bspfile);
-		j = j + fread(&(edgelist[i].vertex1), sizeof(unsigned short), 1, bspfile);
-		if (j < 2)
-			break;
-		i++;
-	}
-	if (i != numedges) {
-		fprintf(stderr, "error %s! only %ld read.\n",strerror(errno),i);
-		return 1;
-	} else {
-		stdprintf("successfully read %ld edges.\n",i);
+	stdprintf("at %ld...",bsp_header.edges.offset);
+	p = bsp->data + bsp_header.edges.offset;
+	for (i=0; i<numedges; i++, p+=BSP_EDGE_SIZE) {
+		edgelist[i].vertex0 = get_short(p);
+		edgelist[i].vertex1 = get_short(p + 2);
 	}
+	stdprintf("successfully read %ld edges.\n",i);
 
 	/* Read ledges   -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
-	ledges = malloc(sizeof(short) * numlistedges);
+	ledges = malloc(sizeof(int) * numlistedges);
 	if (ledges == NULL) {
-		fprintf(stderr,"Error allocating %ld bytes for ledges.",sizeof(short) * numlistedges);
-		return 2;
+		fprintf(stderr,"Error allocating %ld bytes for ledges.",(long)sizeof(int) * numlistedges);
+		ret = 2;
+		goto cleanup;
 	}
 
 	stdprintf("Reading ledges...");
-	if (fseek(bspfile,bsp_header.ledges.offset,SEEK_SET)) {
-		fprintf(stderr, "error seeking to %ld\n",bsp_header.ledges.offset);
-		return 1;
-	} else {
-		stdprintf("seek to %ld...",ftell(bspfile));
+	stdprintf("at %ld...",bsp_header.ledges.offset);
+	p = bsp->data + bsp_header.ledges.offset;
+	for (i=0; i<numlistedges; i++, p+=BSP_LEDGE_SIZE) {
+		ledges[i] = (int)get_long(p);
 	}
-	i=fread(ledges,sizeof(short),numlistedges,bspfile);
-	if (i != numlistedges) {
-		fprintf(stderr, "error %s! only %ld read.\n",strerror(errno),i);
-		return 1;
-	} else {
-		stdprintf("successfully read %ld ledges.\n",i);
+	stdprintf("successfully read %ld ledges.\n",i);
+
+	/* Read faces -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
+	facelist = malloc(sizeof(struct face_t) * numfaces);
+	if (facelist == NULL) {
+		fprintf(stderr,"Error allocating %ld bytes for faces.",(long)sizeof(struct face_t) * numfaces);
+		ret = 2;
+		goto cleanup;
+	}
+
+	stdprintf("Reading faces...");
+	stdprintf("at %ld...",bsp_header.faces.offset);
+	p = bsp->data + bsp_header.faces.offset;
+	for (i=0; i<numfaces; i++, p+=BSP_FACE_SIZE) {
+		facelist[i].plane_id   = get_short(p);
+		facelist[i].side       = get_short(p + 2);
+		facelist[i].ledge_id   = get_long(p + 4);
+		facelist[i].ledge_num  = get_short(p + 8);
+		facelist[i].texinfo_id = get_short(p + 10);
+		facelist[i].typelight  = p[12];
+		facelist[i].baselight  = p[13];
+		facelist[i].light[0]   = p[14];
+		facelist[i].light[1]   = p[15];
+		facelist[i].lightmap   = get_long(p + 16);
+	}
+	stdprintf("successfully read %ld faces.\n",i);
+
+	/* Read models   -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
+	modellist = malloc(sizeof(struct model_t) * (nummodels + 1));
+	if (modellist == NULL) {
+		fprintf(stderr,"Error allocating %ld bytes for models.",(long)sizeof(struct model_t) * nummodels);
+		ret = 2;
+		goto cleanup;
+	}
+
+	stdprintf("Reading models...");
+	stdprintf("at %ld...",bsp_header.models.offset);
+	p = bsp->data + bsp_header.models.offset;
+	for (i=0; i<nummodels; i++, p+=BSP_MODEL_SIZE) {
+		modellist[i].bound_min.X = get_float(p);
+		modellist[i].bound_min.Y = get_float(p + 4);
+		modellist[i].bound_min.Z = get_float(p + 8);
+		modellist[i].bound_max.X = get_float(p + 12);
+		modellist[i].bound_max.Y = get_float(p + 16);
+		modellist[i].bound_max.Z = get_float(p + 20);
+		modellist[i].origin.X    = get_float(p + 24);
+		modellist[i].origin.Y    = get_float(p + 28);
+		modellist[i].origin.Z    = get_float(p + 32);
+		for (j=0; j<4; j++)
+			modellist[i].node_id[j] = get_long(p + 36 + j*4);
+		modellist[i].numleafs = get_long(p + 52);
+		modellist[i].face_id  = get_long(p + 56);
+		modellist[i].face_num = get_long(p + 60);
+	}
+	stdprintf("successfully read %ld models.\n",i);
+
+	/* Read planes   -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
+	planelist = malloc(sizeof(struct plane_t) * (numplanes + 1));
+	if (planelist == NULL) {
+		fprintf(stderr,"Error allocating %ld bytes for planes.",(long)sizeof(struct plane_t) * numplanes);
+		ret = 2;
+		goto cleanup;
+	}
+
+	stdprintf("Reading planes...");
+	stdprintf("at %ld...",bsp_header.planes.offset);
+	p = bsp->data + bsp_header.planes.offset;
+	for (i=0; i<numplanes; i++, p+=BSP_PLANE_SIZE) {
+		planelist[i].normal.X = get_float(p);
+		planelist[i].normal.Y = get_float(p + 4);
+		planelist[i].normal.Z = get_float(p + 8);
+		planelist[i].dist     = get_float(p + 12);
+		planelist[i].type     = get_long(p + 16);
+	}
+	stdprintf("successfully read %ld planes.\n",i);
+
+	/* Read texinfo  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
+	texinfolist = malloc(sizeof(struct texinfo_t) * (numtexinfo + 1));
+	if (texinfolist == NULL) {
+		fprintf(stderr,"Error allocating %ld bytes for texinfo.",(long)sizeof(struct texinfo_t) * numtexinfo);
+		ret = 2;
+		goto cleanup;
 	}
 
-	/* Read faces -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
-	facelist = malloc(sizeof(struct face_t) * numfaces);
-	if (facelist == NULL) {
-		fprintf(stderr,"Error allocating %ld bytes for faces.",sizeof(short) * numfaces);
-		return 2;
+	stdprintf("Reading texinfo...");
+	stdprintf("at %ld...",bsp_header.texinfo.offset);
+	p = bsp->data + bsp_header.texinfo.offset;
+	for (i=0; i<numtexinfo; i++, p+=BSP_TEXINFO_SIZE) {
+		texinfolist[i].vectorS.X  = get_float(p);
+		texinfolist[i].vectorS.Y  = get_float(p + 4);
+		texinfolist[i].vectorS.Z  = get_float(p + 8);
+		texinfolist[i].distS      = get_float(p + 12);
+		texinfolist[i].vectorT.X  = get_float(p + 16);
+		texinfolist[i].vectorT.Y  = get_float(p + 20);
+		texinfolist[i].vectorT.Z  = get_float(p + 24);
+		texinfolist[i].distT      = get_float(p + 28);
+		texinfolist[i].texture_id = get_long(p + 32);
+		texinfolist[i].animated   = get_long(p + 36);
+	}
+	stdprintf("successfully read %ld texinfo.\n",i);
+
+	/* Read miptex names -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
+	/* long numtex; long offset[numtex]; then each miptex, name first */
+	stdprintf("Reading texture names...");
+	stdprintf("at %ld...",bsp_header.miptex.offset);
+	p = bsp->data + bsp_header.miptex.offset;
+	numtextures = (bsp_header.miptex.size >= 4) ? get_long(p) : 0;
+	texnames = malloc(sizeof(*texnames) * (numtextures + 1));
+	if (texnames == NULL) {
+		fprintf(stderr,"Error allocating %ld bytes for texture names.",(long)sizeof(*texnames) * numtextures);
+		ret = 2;
+		goto cleanup;
+	}
+	for (i=0; i<numtextures; i++) {
+		/* missing textures have an offset of -1 */
+		j = get_long(p + 4 + i*4);
+		if (j >= 0 && j + MIPTEX_NAME <= bsp_header.miptex.size) {
+			memcpy(texnames[i], p + j, MIPTEX_NAME);
+			texnames[i][MIPTEX_NAME] = '\0';
+		} else {
+			texnames[i][0] = '\0';
+		}
+	}
+	stdprintf("successfully read %ld texture names.\n",i);
+	/* decoding the lumps is part of loading the map */
+	stats.stage[STAGE_LOAD] += timer() - t0;
+	t0 = timer();
+	if (cancelled)
+		goto cleanup;
+
+	/* Pick faces by model, plane orientation, texture and visibility  -   */
+	if (options.face_driven || options.model_list != NULL || options.plane_axes != 0 || options.num_tex_exclude > 0 || options.viewpoint != NULL) {
+		face_sel = malloc(sizeof(eightbit) * (numfaces + 1));
+		if (face_sel == NULL) {
+			fprintf(stderr,"Error allocating face selection.");
+			ret = 2;
+			goto cleanup;
+		}
+
+		if (options.model_list != NULL) {
+			model_sel = malloc(sizeof(eightbit) * (nummodels + 1));
+			if (model_sel == NULL) {
+				fprintf(stderr,"Error allocating model selection.");
+				ret = 2;
+				goto cleanup;
+			}
+			j = select_list(options.model_list, nummodels, model_sel);
+			stdprintf("Selected %ld of %ld models.\n", j, nummodels);
+
+			/* walk each model's face range */
+			memset(face_sel, 0, sizeof(eightbit) * numfaces);
+			for (i=0; i<nummodels; i++) {
+				if (!model_sel[i])
+					continue;
+				for (j=modellist[i].face_id; j<modellist[i].face_id + modellist[i].face_num; j++)
+					face_sel[j] = 1;
+			}
+		} else {
+			memset(face_sel, 1, sizeof(eightbit) * numfaces);
+		}
+
+		if (options.plane_axes != 0) {
+			for (i=0; i<numfaces; i++) {
+				if (!(options.plane_axes & (1 << (planelist[facelist[i].plane_id].type % 3))))
+					face_sel[i] = 0;
+			}
+		}
+
+		if (options.num_tex_exclude > 0) {
+			/* match each texture once, not each face */
+			tex_drop = malloc(sizeof(eightbit) * (numtextures + 1));
+			if (tex_drop == NULL) {
+				fprintf(stderr,"Error allocating texture selection.");
+				ret = 2;
+				goto cleanup;
+			}
+			k = 0;
+			for (i=0; i<numtextures; i++) {
+				tex_drop[i] = 0;
+				for (j=0; j<options.num_tex_exclude && !tex_drop[i]; j++)
+					tex_drop[i] = match_list(options.tex_exclude[j], texnames[i]);
+				if (tex_drop[i]) {
+					stdprintf("Skipping texture %s\n",texnames[i]);
+					k++;
+				}
+			}
+
+			x = 0;
+			for (i=0; i<numfaces; i++) {
+				if (!face_sel[i])
+					continue;
+				if (tex_drop[texinfolist[facelist[i].texinfo_id].texture_id]) {
+					face_sel[i] = 0;
+					x++;
+				}
+			}
+			stdprintf("Skipped %ld faces with %ld of %ld textures.\n", x, k, numtextures);
+		}
+
+		if (options.viewpoint != NULL) {
+			if (options.color_mode == COLOR_VIS && (face_seen = malloc(sizeof(long) * (numfaces + 1))) == NULL) {
+				fprintf(stderr,"Error allocating face visibility.\n");
+				ret = 2;
+				goto cleanup;
+			}
+			if (pick_visible(&options, bsp, &bsp_header, planelist, modellist, nummodels, numfaces, face_sel, face_seen, &numviews)) {
+				ret = 1;
+				goto cleanup;
+			}
+		}
 	}
 
-	stdprintf("Reading faces...");
-	if (fseek(bspfile,bsp_header.faces.offset,SEEK_SET)) {
-		fprintf(stderr, "error seeking to %ld\n",bsp_header.faces.offset);
-		return 1;
-	} else {
-		stdprintf("seek to %ld...",ftell(bspfile));
-	}
-	/* OLD:
-	i=fread(facelist,sizeof(struct face_t),numfaces,bspfile);
-	*/
-	i = 0;
-	while (i < numfaces) {
-		j = 0;
-		j = j + fread(&(facelist[i].plane_id),sizeof(unsigned short), 1, bspfile);
-		j = j + fread(&(facelist[i].side),sizeof(unsigned short), 1, bspfile);
-		j = j + fread(&(facelist[i].ledge_id),sizeof(long), 1, bspfile);
-		j = j + fread(&(facelist[i].ledge_num),sizeof(unsigned short), 1, bspfile);
-		j = j + fread(&(facelist[i].texinfo_id),sizeof(unsigned short), 1, bspfile);
-		j = j + fread(&(facelist[i].typelight),sizeof(unsigned char), 1, bspfile);
-		j = j + fread(&(facelist[i].baselight),sizeof(unsigned char), 1, bspfile);
-		j = j + fread(&(facelist[i].light[0]),sizeof(unsigned char), 1, bspfile);
-		j = j + fread(&(facelist[i].light[1]),sizeof(unsigned char), 1, bspfile);
-		j = j + fread(&(facelist[i].lightmap),sizeof(long), 1, bspfile);
-		if (j < 10)
-			break;
-		i++;
+	if (options.color_mode == COLOR_VIS && face_seen == NULL) {
+		stdprintf("Note: -kv needs -v, edges are left flat.\n");
+		options.color_mode = COLOR_GRAY;
 	}
-	if (i != numfaces) {
-		fprintf(stderr, "error %s! only %ld read.\n",strerror(errno),i);
-		return 1;
+
+	/* Face-driven: list each edge of the picked faces once -  -  -  -  -   */
+	if (face_sel != NULL) {
+		edge_seen = malloc(sizeof(uint32_t) * ((numedges + 31) / 32));
+		drawlist = malloc(sizeof(long) * (numedges + 1));
+		if (edge_seen == NULL || drawlist == NULL) {
+			fprintf(stderr,"Error allocating %ld bytes for edge list.",(long)sizeof(long) * numedges);
+			ret = 2;
+			goto cleanup;
+		}
+		memset(edge_seen, 0, sizeof(uint32_t) * ((numedges + 31) / 32));
+
+		x = 0;
+		for (i=0; i<numfaces; i++) {
+			if (!face_sel[i])
+				continue;
+			x++;
+			for (j=facelist[i].ledge_id; j<facelist[i].ledge_id + facelist[i].ledge_num; j++) {
+				k = abs(ledges[j]);
+				if (!(edge_seen[k >> 5] & (1u << (k & 31)))) {
+					edge_seen[k >> 5] |= (1u << (k & 31));
+					drawlist[numdraw++] = k;
+				}
+			}
+		}
+		stdprintf("Drawing %ld faces: %ld of %ld edges.\n", x, numdraw, numedges);
 	} else {
-		stdprintf("successfully read %ld faces.\n",i);
+		numdraw = numedges;
 	}
 
 	/* Should be done reading stuff -  -  -  -  -  -  -  -  -  -  -  -   */
-	fclose(bspfile);
 
 	/* Precalc stuff if we're removing edges -  -  -  -  -  -  -  -  -   */
 	/*
@@ -878,11 +4233,13 @@ int main(int argc, char *argv[]) {
 		edge_extra = malloc(sizeof(struct edge_extra_t) * numedges);
 		if (edge_extra == NULL) {
 			fprintf(stderr,"Error allocating %ld bytes for extra edge info.",sizeof(struct edge_extra_t) * numedges);
-			return 2;
+			ret = 2;
+			goto cleanup;
 		}
 		
-		/* initialize the array */
-		for (i=0; i<numedges; i++) {
+		/* initialize the array, only the listed edges are ever looked at */
+		for (n=0; n<numdraw; n++) {
+			i = (drawlist != NULL) ? drawlist[n] : n;
 			edge_extra[i].num_face_ref=0;
 			for (j=0;j<MAX_REF_FACES;j++) {
 				edge_extra[i].ref_faces[j]=-1;
@@ -890,6 +4247,9 @@ int main(int argc, char *argv[]) {
 		} 
 		
 		for (i=0; i<numfaces; i++) {
+			if (face_sel != NULL && !face_sel[i])
+				continue;
+
 			/* calculate the normal (cross product) */
 			/*   starting edge: edgelist[ledges[facelist[i].ledge_id]] */
 			/* number of edges: facelist[i].ledge_num; */
@@ -898,7 +4258,8 @@ int main(int argc, char *argv[]) {
 			j=facelist[i].ledge_id;
 			k=j;
 			vect.X = 0.0; vect.Y = 0.0; vect.Z = 0.0;
-			while (vect.X == 0.0 && vect.Y == 0.0 && vect.Z == 0.0 && k < (facelist[i].ledge_num + j)) {
+			area = 0;
+			while (vect.X == 0.0 && vect.Y == 0.0 && vect.Z == 0.0 && k + 1 < (facelist[i].ledge_num + j)) {
 				/* If the first 2 are par?llel edges, go with the next one */
 				k++;
 				/*
@@ -931,7 +4292,8 @@ int main(int argc, char *argv[]) {
 				vect.Z = (v0.X * v1.Y) - (v0.Y * v1.X);
 
 				/* Okay, it's not the REAL area, but i'm lazy, and since a lot of mapmakers use rectangles anyways... */
-				area = (int)(sqrt(v0.X*v0.X + v0.Y*v0.Y + v0.Z*v0.Z) * sqrt(v1.X*v1.X + v1.Y*v1.Y + v1.Z*v1.Z));
+				tempf2 = sqrt(v0.X*v0.X + v0.Y*v0.Y + v0.Z*v0.Z) * sqrt(v1.X*v1.X + v1.Y*v1.Y + v1.Z*v1.Z);
+				area = (tempf2 < (float)MAXINT) ? (int)tempf2 : MAXINT;
 			} /* while */
 			
 			/* reduce cross product to a unit vector */
@@ -968,85 +4330,159 @@ int main(int argc, char *argv[]) {
 
 	/* . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . */
 
-	stdprintf("Collecting min/max\n");
-	/* Collect min and max */
-	for (i=0;i<numvertices;i++) {
-		/* DEBUG - print vertices */
-		// stdprintf("vertex %ld: (%f, %f, %f)\n", i, vertexlist[i].X, vertexlist[i].Y, vertexlist[i].Z);
-
-		
-		/* Ugly hack - flip stuff around for different camera angles */
-		switch(options.camera_axis) {
-			case -1:
-				/* -X -- (-y <-->  +y, +x into screen, -x out of screen; -z down, +z up) */
-				tempf = vertexlist[i].X;
-				vertexlist[i].X = vertexlist[i].Y;
-				vertexlist[i].Y = vertexlist[i].Z;
-				vertexlist[i].Z = -tempf;
-				break;
-			case 1:
-				/* +X -- (+y <--> -y; -x into screen, +x out of screen; -z down, +z up) */
-				tempf = vertexlist[i].X;
-				vertexlist[i].X = -vertexlist[i].Y;
-				vertexlist[i].Y =  vertexlist[i].Z;
-				vertexlist[i].Z =  tempf;
-				break;
-			case -2:
-				/* -Y -- (+x <--> -x; -y out of screen, +z up) */
-				vertexlist[i].X = -vertexlist[i].X;
-				tempf = vertexlist[i].Z;
-				vertexlist[i].Z = vertexlist[i].Y;
-				vertexlist[i].Y =  tempf;
-				break;
-			case 2:
-				/* +Y -- (-x <--> +x; +y out of screen, +z up) */
-				tempf = vertexlist[i].Z;
-				vertexlist[i].Z = -vertexlist[i].Y;
-				vertexlist[i].Y =  tempf;
-				break;
-			case -3:
-				/* -Z -- negate X and Z (ie. 180 rotate along Y axis) */
-				vertexlist[i].X = -vertexlist[i].X;
-				vertexlist[i].Z = -vertexlist[i].Z;
-				break;
-			case 3:	/* +Z -- do nothing! */
-			default:/* do nothing! */
-				break;
-		} /* switch */
-		
-		/* flip Y for proper screen cords */
-		vertexlist[i].Y = -vertexlist[i].Y;
-		
-		/* max and min */
-		if (i == 0) {
-			minX = vertexlist[i].X;
-			maxX = vertexlist[i].X;
-			
-			minY = vertexlist[i].Y;
-			maxY = vertexlist[i].Y;
-			
-			minZ = vertexlist[i].Z;
-			maxZ = vertexlist[i].Z;
+	/* Compare with the old map: its edges that are gone join the lists */
+	if (options.diff_name != NULL) {
+		stdprintf("Comparing with %s...\n",options.diff_name);
+		i = diff_maps(options.diff_name, &vertexlist, &numvertices, &edgelist, &numedges, ledges, numlistedges, &drawlist, &numdraw, &edge_diff);
+		if (i != 0) {
+			ret = (int)i;
+			goto cleanup;
+		}
+		options.color_mode = COLOR_DIFF;
+	}
+	if (cancelled)
+		goto cleanup;
+
+	/* Layers: the Z slices (in world space) each edge and face is drawn in */
+	memset(layer, 0, sizeof(layer));
+	if (options.layers > 0 && (options.frames > 0 || options.write_svg || is_stdio(options.outf_name))) {
+		stdprintf("Note: -L only applies to bitmaps written to files, and not with -T.\n");
+	} else if (options.layers > 0) {
+		numlayers = options.layers;
+		if (options.layer_has_z) {
+			memcpy(bound, options.layer_z, sizeof(float) * (numlayers + 1));
 		} else {
-			if (vertexlist[i].X < minX)
-				minX=vertexlist[i].X;
-			if (vertexlist[i].X > maxX)
-				maxX=vertexlist[i].X;
+			bound[0] = bound[numlayers] = (numvertices > 0) ? vertexlist[0].Z : 0.0;
+			for (i=1; i<numvertices; i++) {
+				bound[0] = fmin(bound[0], vertexlist[i].Z);
+				bound[numlayers] = fmax(bound[numlayers], vertexlist[i].Z);
+			}
+			for (k=1; k<numlayers; k++)
+				bound[k] = bound[0] + (bound[numlayers] - bound[0]) * (float)k / (float)numlayers;
+		}
+		for (k=0; k<numlayers; k++)
+			stdprintf("Layer %ld: Z %g .. %g\n",k + 1,bound[k],bound[k+1]);
+		if (options.hidden_lines) {
+			/* one depth buffer would have each floor hiding the ones below */
+			stdprintf("Note: -o is left out with -L.\n");
+			options.hidden_lines = 0;
+		}
 
-			if (vertexlist[i].Y < minY)
-				minY=vertexlist[i].Y;
-			if (vertexlist[i].Y > maxY)
-				maxY=vertexlist[i].Y;
+		edge_lay = malloc(sizeof(uint32_t) * (numedges + 1));
+		face_lay = malloc(sizeof(uint32_t) * (numfaces + 1));
+		if (edge_lay == NULL || face_lay == NULL) {
+			fprintf(stderr,"Error allocating layers.\n");
+			ret = 2;
+			goto cleanup;
+		}
+		for (i=0; i<numedges; i++) {
+			tempf = vertexlist[edgelist[i].vertex0].Z;
+			tempf2 = vertexlist[edgelist[i].vertex1].Z;
+			edge_lay[i] = layer_mask(fmin(tempf, tempf2), fmax(tempf, tempf2), bound, numlayers);
+		}
+		for (i=0; i<numfaces; i++) {
+			tempf = FLT_MAX;
+			tempf2 = -FLT_MAX;
+			for (j=0; j<facelist[i].ledge_num; j++) {
+				x = ledges[facelist[i].ledge_id + j];
+				x = (x >= 0) ? edgelist[x].vertex0 : edgelist[-x].vertex1;
+				tempf = fmin(tempf, vertexlist[x].Z);
+				tempf2 = fmax(tempf2, vertexlist[x].Z);
+			}
+			face_lay[i] = (j > 0) ? layer_mask(tempf, tempf2, bound, numlayers) : 0;
+		}
+	}
 
-			if (vertexlist[i].Z < minZ)
-				minZ=vertexlist[i].Z;
-			if (vertexlist[i].Z > maxZ)
-				maxZ=vertexlist[i].Z;
+	stats.stage[STAGE_PRECALC] += timer() - t0;
+	t0 = timer();
+	if (cancelled)
+		goto cleanup;
+
+	/* A turntable renders from here on once per frame; keep what the
+	   camera changes, so each frame starts from the map as loaded */
+	if (options.frames > 0) {
+		options.bitcount = 8;
+		options.write_svg = 0;
+		numverts0 = numvertices;
+		numdraw0 = numdraw;
+		world = malloc(sizeof(struct vertex_t) * (numvertices + 1));
+		edges0 = malloc(sizeof(struct edge_t) * (numedges + 1));
+		draw0 = (drawlist != NULL) ? malloc(sizeof(long) * (numdraw + 1)) : NULL;
+		if (world == NULL || edges0 == NULL || (drawlist != NULL && draw0 == NULL)) {
+			fprintf(stderr,"Error allocating turntable buffers.\n");
+			ret = 2;
+			goto cleanup;
 		}
+		memcpy(world, vertexlist, sizeof(struct vertex_t) * numvertices);
+		memcpy(edges0, edgelist, sizeof(struct edge_t) * numedges);
+		if (draw0 != NULL)
+			memcpy(draw0, drawlist, sizeof(long) * numdraw);
+
+		/* progress is counted in frames, not the stages of each */
+		frames_hook = progress_hook;
+		progress_hook = NULL;
 	}
 
+next_frame:
+	if (options.frames > 0) {
+		options.cam_orbit = 360.0 * (float)frame / (float)options.frames;
+		if (frames_hook != NULL)
+			frames_hook("frames", frame, options.frames);
+	}
+
+	stdprintf("Collecting min/max\n");
+	/* Collect min and max */
+	if (options.free_camera) {
+		make_camera(&cam, &options, vertexlist, numvertices);
+		camera_view(&cam, vertexlist, numvertices);
+		if ((vflag = calloc(numvertices + 1, 1)) == NULL) {
+			fprintf(stderr,"Error allocating vertex flags.\n");
+			ret = 2;
+			goto cleanup;
+		}
+		/* edges running behind the eye are cut short first */
+		if (cam.persp) {
+			numvertices = near_clip(&vertexlist, numvertices, &vflag, edgelist, numedges, &drawlist, &numdraw);
+			if (numvertices < 0) {
+				fprintf(stderr,"Error allocating clipped edges.\n");
+				ret = 2;
+				goto cleanup;
+			}
+		}
+		camera_project(&cam, vertexlist, numvertices, vflag, &v0, &v1);
+		clip_lines = cam.persp;
+
+		/* every frame of a turntable the same size: all the map can
+		   reach as it turns */
+		if (options.frames > 0) {
+			v0.X = v0.Y = cam.persp ? -cam.half : -cam.radius;
+			v1.X = v1.Y = -v0.X;
+			if (!cam.persp) {
+				v0.Z = -cam.radius;
+				v1.Z = cam.radius;
+			}
+			clip_lines = 1;
+		}
+	} else {
+		camera_list(vertexlist, numvertices, options.camera_axis, &v0, &v1);
+	}
+	minX = v0.X;  maxX = v1.X;
+	minY = v0.Y;  maxY = v1.Y;
+	minZ = v0.Z;  maxZ = v1.Z;
+
+	/* the map's real Z extent, for coloring by height */
+	zlo = minZ;
+	zhi = maxZ;
+
+	if (options.free_camera) {
+		/* a real camera has no use for the fake one */
+		options.z_pad = 0;
+		if (maxZ <= minZ)
+			maxZ = minZ + 1.0;
+	} else {
 minX = minY = minZ = -4096;
 maxX = maxY = maxZ = 4096;
+	}
 	
 	if (options.z_pad == -1)
 		options.z_pad = (long)(maxZ - minZ) / (options.scaledown * Z_PAD_HACK);
@@ -1060,12 +4496,112 @@ maxX = maxY = maxZ = 4096;
 	/* image array */
 	imagewidth  = (long)((maxX - minX)/options.scaledown) + (options.image_pad*2) + (options.z_pad*2);
 	imageheight = (long)((maxY - minY)/options.scaledown) + (options.image_pad*2) + (options.z_pad*2);
-	if(!(image=malloc(sizeof(eightbit) * imagewidth * imageheight))) {
+
+	/* A region: the image only covers that part of the map, and is moved
+	   over by org_x, org_y pixels */
+	if (options.use_region && options.free_camera) {
+		/* the region's rectangle through the middle of the map, and the
+		   part of the image it covers */
+		for (i=0; i<4; i++) {
+			v0.X = options.region[(i & 1) ? 2 : 0];
+			v0.Y = options.region[(i & 2) ? 3 : 1];
+			v0.Z = cam.center.Z;
+			camera_point(&cam, &v0);
+			if (i == 0)
+				corner[0] = corner[1] = v0;
+			corner[0].X = fmin(corner[0].X, v0.X);  corner[1].X = fmax(corner[1].X, v0.X);
+			corner[0].Y = fmin(corner[0].Y, v0.Y);  corner[1].Y = fmax(corner[1].Y, v0.Y);
+		}
+	} else if (options.use_region) {
+		for (i=0; i<2; i++) {
+			tempf = options.region[i * 2];
+			tempf2 = options.region[i * 2 + 1];
+			switch (abs(options.camera_axis)) {
+				case 1:
+					corner[i].X = 0.0; corner[i].Y = tempf; corner[i].Z = tempf2;
+					break;
+				case 2:
+					corner[i].X = tempf; corner[i].Y = 0.0; corner[i].Z = tempf2;
+					break;
+				default:
+					corner[i].X = tempf; corner[i].Y = tempf2; corner[i].Z = 0.0;
+					break;
+			}
+			to_camera(&corner[i], options.camera_axis);
+		}
+	}
+	if (options.use_region) {
+		org_x = (long)floor((fmin(corner[0].X, corner[1].X) - minX)/options.scaledown);
+		org_y = (long)floor((fmin(corner[0].Y, corner[1].Y) - minY)/options.scaledown);
+		imagewidth  = (long)ceil(fabs(corner[1].X - corner[0].X)/options.scaledown) + (options.image_pad*2) + (options.z_pad*2);
+		imageheight = (long)ceil(fabs(corner[1].Y - corner[0].Y)/options.scaledown) + (options.image_pad*2) + (options.z_pad*2);
+		stdprintf("Region at %ld,%ld of the full image.\n",org_x,org_y);
+	}
+	/* (rounding may differ a pixel as it turns, the video can't) */
+	if (options.frames > 0 && frame > 0) {
+		imagewidth = width0;
+		imageheight = height0;
+	}
+	width0 = imagewidth;
+	height0 = imageheight;
+	bpp = options.bitcount / 8;
+	stats.width = imagewidth;
+	stats.height = imageheight;
+	t1 = timer();
+	if (options.write_svg) {
+		/* nothing is rasterized; colors are kept as RGB */
+		bpp = 3;
+		image = NULL;
+		if (options.hidden_lines || options.entity_overlay || options.floor_plan || options.height_name != NULL)
+			stdprintf("Note: -o, -E, -G and -H only apply to bitmaps.\n");
+		options.hidden_lines = 0;
+		options.entity_overlay = 0;
+		options.floor_plan = 0;
+		options.height_name = NULL;
+	} else if (image == NULL && !(image=malloc(sizeof(eightbit) * imagewidth * imageheight * bpp))) {
 		fprintf(stderr,"Error allocating image buffer %ldx%ld.\n",imagewidth,imageheight);
-		return 0;
+		ret = 2;
+		goto cleanup;
 	} else {
 		stdprintf("Allocated buffer %ldx%ld for image.\n",imagewidth,imageheight);
-		memset(image,0,sizeof(eightbit) * imagewidth * imageheight);
+		memset(image,0,sizeof(eightbit) * imagewidth * imageheight * bpp);
+	}
+	/* clearing the image counts as drawing, not transforming */
+	t1 = timer() - t1;
+	stats.stage[STAGE_RASTERIZE] += t1;
+	t0 += t1;
+	canvas.image = image;
+	canvas.width = imagewidth;
+	canvas.height = imageheight;
+	canvas.bpp = bpp;
+
+	/* -H: the height map is filled in as the lines are drawn */
+	if (options.frames > 0 && options.height_name != NULL) {
+		stdprintf("Note: -H is ignored with -T.\n");
+		options.height_name = NULL;
+	}
+	canvas.zmap = NULL;
+	canvas.zmap_min = options.height_min;
+	canvas.zmap_lo = zlo;
+	canvas.zmap_scale = (zhi > zlo) ? 65534.0 / (zhi - zlo) : 0.0;
+	if (options.height_name != NULL) {
+		if ((zmap = calloc(imagewidth * imageheight, sizeof(uint16_t))) == NULL) {
+			fprintf(stderr,"Error allocating height map %ldx%ld.\n",imagewidth,imageheight);
+			ret = 2;
+			goto cleanup;
+		}
+		canvas.zmap = zmap;
+	}
+
+	/* each layer draws on an image of its own, the first on image */
+	layer[0] = canvas;
+	for (l=1; l<numlayers; l++) {
+		layer[l] = canvas;
+		if ((layer[l].image = calloc(imagewidth * imageheight, bpp)) == NULL) {
+			fprintf(stderr,"Error allocating layer %d image %ldx%ld.\n",l + 1,imagewidth,imageheight);
+			ret = 2;
+			goto cleanup;
+		}
 	}
 
 	/* Zoffset calculations */
@@ -1116,11 +4652,251 @@ maxX = maxY = maxZ = 4096;
 			break;
 	}
 
+	/* Where each vertex lands on the image */
+	sx = malloc(sizeof(float) * (numvertices + 1));
+	sy = malloc(sizeof(float) * (numvertices + 1));
+	spt = malloc(sizeof(struct spoint_t) * (numvertices + 1));
+	if (sx == NULL || sy == NULL || spt == NULL) {
+		fprintf(stderr,"Error allocating vertex buffers.\n");
+		ret = 2;
+		goto cleanup;
+	}
+	for (i=0; i<numvertices; i++) {
+		Zoffset0=(long)(options.z_pad * (vertexlist[i].Z - midZ) / (maxZ - minZ));
+		sx[i] = (vertexlist[i].X - minX)/options.scaledown + options.image_pad + options.z_pad + (float)(Zoffset0 * Z_Xdir) - (float)org_x;
+		sy[i] = (vertexlist[i].Y - minY)/options.scaledown + options.image_pad + options.z_pad + (float)(Zoffset0 * Z_Ydir) - (float)org_y;
+		spt[i].x = (long)floor(sx[i]);
+		spt[i].y = (long)floor(sy[i]);
+		spt[i].z = vertexlist[i].Z;
+	}
+
+	stats.stage[STAGE_TRANSFORM] += timer() - t0;
+	t0 = timer();
+	if (cancelled)
+		goto cleanup;
+
+	/* Hidden line removal: depth of the nearest face facing the camera */
+	if (options.hidden_lines) {
+		stdprintf("Filling depth buffer...");
+		zbuf = malloc(sizeof(float) * imagewidth * imageheight);
+		if (zbuf == NULL) {
+			fprintf(stderr,"Error allocating depth buffer %ldx%ld.\n",imagewidth,imageheight);
+			ret = 2;
+			goto cleanup;
+		}
+		for (i=0; i<imagewidth * imageheight; i++)
+			zbuf[i] = -FLT_MAX;
+
+		/* from the map towards the camera; Z offsetting makes it oblique */
+		tempf = options.z_pad * options.scaledown / (maxZ - minZ);
+		eye.X = -tempf * (float)Z_Xdir;
+		eye.Y = -tempf * (float)Z_Ydir;
+		eye.Z = 1.0;
+
+		x = 0;
+		for (i=0; i<numfaces; i++) {
+			if (facelist[i].ledge_num > x)
+				x = facelist[i].ledge_num;
+		}
+		facex = malloc(sizeof(float) * (x + 1));
+		facey = malloc(sizeof(float) * (x + 1));
+		facez = malloc(sizeof(float) * (x + 1));
+		if (facex == NULL || facey == NULL || facez == NULL) {
+			fprintf(stderr,"Error allocating face buffers.\n");
+			ret = 2;
+			goto cleanup;
+		}
+
+		k = 0;
+		for (i=0; i<numfaces; i++) {
+			if ((i & 255) == 0) {
+				if (cancelled)
+					break;
+				progress("depth", i, numfaces);
+			}
+			if (face_sel != NULL && !face_sel[i])
+				continue;
+
+			/* skip faces turned away from the camera */
+			vect = planelist[facelist[i].plane_id].normal;
+			if (facelist[i].side) {
+				vect.X = -vect.X;
+				vect.Y = -vect.Y;
+				vect.Z = -vect.Z;
+			}
+			if (!options.free_camera)
+				to_camera(&vect, options.camera_axis);
+			else if (!cam.persp)
+				camera_dir(&cam, &vect);
+			/* (with perspective it depends where the face is, the depth
+			   test sorts it out) */
+			if ((!options.free_camera || !cam.persp) && vect.X * eye.X + vect.Y * eye.Y + vect.Z * eye.Z <= 0.0)
+				continue;
+
+			for (j=0; j<facelist[i].ledge_num; j++) {
+				x = ledges[facelist[i].ledge_id + j];
+				x = (x >= 0) ? edgelist[x].vertex0 : edgelist[-x].vertex1;
+				/* faces reaching behind the eye are left out */
+				if (vflag != NULL && vflag[x])
+					break;
+				facex[j] = sx[x];
+				facey[j] = sy[x];
+				facez[j] = vertexlist[x].Z;
+			}
+			if (j < facelist[i].ledge_num)
+				continue;
+			depthface(zbuf, imagewidth, imageheight, facex, facey, facez, facelist[i].ledge_num);
+			k++;
+		}
+		progress("depth", numfaces, numfaces);
+		stdprintf("%ld faces.\n",k);
+
+		free(facex);     facex = NULL;
+		free(facey);     facey = NULL;
+		free(facez);     facez = NULL;
+	}
+
+	/* Floor plan: faces near level and facing the camera are filled in
+	   under the edges, far ones first so the nearest ends up on top  -   */
+	if (options.floor_plan) {
+		stdprintf("Filling floors...");
+		tempf = options.z_pad * options.scaledown / (maxZ - minZ);
+		eye.X = -tempf * (float)Z_Xdir;
+		eye.Y = -tempf * (float)Z_Ydir;
+		eye.Z = 1.0;
+
+		x = 0;
+		for (i=0; i<numfaces; i++) {
+			if (facelist[i].ledge_num > x)
+				x = facelist[i].ledge_num;
+		}
+		floors = malloc(sizeof(struct floor_t) * (numfaces + 1));
+		facex = malloc(sizeof(float) * (x + 1));
+		facey = malloc(sizeof(float) * (x + 1));
+		if (floors == NULL || facex == NULL || facey == NULL) {
+			fprintf(stderr,"Error allocating floor buffers.\n");
+			ret = 2;
+			goto cleanup;
+		}
+
+		numfloors = 0;
+		for (i=0; i<numfaces; i++) {
+			if (face_sel != NULL && !face_sel[i])
+				continue;
+
+			vect = planelist[facelist[i].plane_id].normal;
+			if (facelist[i].side) {
+				vect.X = -vect.X;
+				vect.Y = -vect.Y;
+				vect.Z = -vect.Z;
+			}
+			if (fabs(vect.Z) < FLOOR_SLOPE)
+				continue;
+			/* floors seen from above, ceilings from below */
+			if (!options.free_camera)
+				to_camera(&vect, options.camera_axis);
+			else if (!cam.persp)
+				camera_dir(&cam, &vect);
+			if ((!options.free_camera || !cam.persp) && vect.X * eye.X + vect.Y * eye.Y + vect.Z * eye.Z <= 0.0)
+				continue;
+
+			/* how near, by the middle of its corners */
+			tempf = 0.0;
+			for (j=0; j<facelist[i].ledge_num; j++) {
+				x = ledges[facelist[i].ledge_id + j];
+				x = (x >= 0) ? edgelist[x].vertex0 : edgelist[-x].vertex1;
+				if (vflag != NULL && vflag[x])
+					break;
+				tempf += vertexlist[x].Z;
+			}
+			if (j < facelist[i].ledge_num || j < 3)
+				continue;
+			floors[numfloors].z = tempf / (float)j;
+			floors[numfloors].face = i;
+			numfloors++;
+		}
+		qsort(floors, numfloors, sizeof(struct floor_t), floor_cmp);
+
+		for (k=0; k<numfloors; k++) {
+			if ((k & 255) == 0) {
+				if (cancelled)
+					break;
+				progress("floors", k, numfloors);
+			}
+			i = floors[k].face;
+			for (j=0; j<facelist[i].ledge_num; j++) {
+				x = ledges[facelist[i].ledge_id + j];
+				x = (x >= 0) ? edgelist[x].vertex0 : edgelist[-x].vertex1;
+				facex[j] = sx[x];
+				facey[j] = sy[x];
+			}
+			color = ramp_color(&canvas, (zhi > zlo) ? (floors[k].z - zlo) / (zhi - zlo) : 0.5, FLOOR_LEVEL);
+			for (l=0; l<numlayers; l++) {
+				if (face_lay == NULL || (face_lay[i] & (1u << l)))
+					fillface(&layer[l], facex, facey, facelist[i].ledge_num, color);
+			}
+		}
+		progress("floors", numfloors, numfloors);
+		stdprintf("%ld faces.\n",numfloors);
+
+		free(floors);    floors = NULL;
+		free(facex);     facex = NULL;
+		free(facey);     facey = NULL;
+	}
+
+	/* Which face (and model) each edge belongs to, for coloring  -  -   */
+	if (options.color_mode == COLOR_NORMAL || options.color_mode == COLOR_MODEL || options.color_mode == COLOR_VIS) {
+		edge_face = malloc(sizeof(long) * (numedges + 1));
+		face_model = malloc(sizeof(long) * (numfaces + 1));
+		if (edge_face == NULL || face_model == NULL) {
+			fprintf(stderr,"Error allocating edge colors.\n");
+			ret = 2;
+			goto cleanup;
+		}
+		for (i=0; i<numedges; i++)
+			edge_face[i] = -1;
+		for (i=0; i<numfaces; i++) {
+			face_model[i] = 0;
+			if (face_sel != NULL && !face_sel[i])
+				continue;
+			for (j=facelist[i].ledge_id; j<facelist[i].ledge_id + facelist[i].ledge_num; j++) {
+				/* (by visibility, the most seen of its faces) */
+				x = edge_face[abs(ledges[j])];
+				if (x < 0 || (face_seen != NULL && face_seen[i] > face_seen[x]))
+					edge_face[abs(ledges[j])] = i;
+			}
+		}
+		for (i=0; i<nummodels; i++) {
+			for (j=modellist[i].face_id; j<modellist[i].face_id + modellist[i].face_num; j++)
+				face_model[j] = i;
+		}
+	}
+
 	/* Plot edges on image */
 	stdprintf("Plotting edges...");
 	k=0;
 	drawcol=(options.edgeremove) ? 64 : 32;
-	for(i=0;i<numedges;i++) {
+	level=(drawcol * 3 > 255) ? 255.0 : (float)(drawcol * 3);
+	color=(bpp == 3) ? (unsigned int)drawcol * 0x010101 : (unsigned int)drawcol;
+
+	/* Edges that pass are collected first, so runs of them can be joined
+	   up before drawing */
+	seg = malloc(sizeof(struct segment_t) * (numdraw + 1));
+	ed_flat = malloc(sizeof(float) * (numdraw + 1));
+	ed_area = malloc(sizeof(int) * (numdraw + 1));
+	ed_len2 = malloc(sizeof(float) * (numdraw + 1));
+	keep = malloc(sizeof(long) * (numdraw + 1));
+	if (seg == NULL || ed_flat == NULL || ed_area == NULL || ed_len2 == NULL || keep == NULL) {
+		fprintf(stderr,"Error allocating segment list.\n");
+		ret = 2;
+		goto cleanup;
+	}
+
+	/* First what the test needs to know about each edge, gathered from the
+	   face and vertex lists into one array per quantity */
+	for(n=0;n<numdraw;n++) {
+		i = (drawlist != NULL) ? drawlist[n] : n;
+
 		/*
 
 		fprintf(stderr, "Edge %ld: vertex %d (%f, %f, %f) -> %d (%f, %f, %f)\n",
@@ -1142,7 +4918,8 @@ maxX = maxY = maxZ = 4096;
 		/* ICK ... do I want to check area of all faces? */
 
 	  	usearea = MAXINT;
-		if (options.edgeremove) {
+		/* (removed edges come from the old map, with no faces here) */
+		if (options.edgeremove && (edge_diff == NULL || edge_diff[i] != DIFF_REMOVED)) {
 			// fprintf(stderr,"Edge %ld - ref=%ld",i,edge_extra[i].num_face_ref);
 			if (edge_extra[i].num_face_ref > 1) {
 				tempf = 1.0;
@@ -1174,35 +4951,207 @@ maxX = maxY = maxZ = 4096;
 			tempf = 0.0;
 		}
 		
-		if ((abs(tempf) < options.flat_threshold) &&
-		    (usearea > options.area_threshold) &&
-		    (sqrt((vertexlist[edgelist[i].vertex0].X - vertexlist[edgelist[i].vertex1].X) *
-		    (vertexlist[edgelist[i].vertex0].X - vertexlist[edgelist[i].vertex1].X) +
-		    (vertexlist[edgelist[i].vertex0].Y - vertexlist[edgelist[i].vertex1].Y) *
-		    (vertexlist[edgelist[i].vertex0].Y - vertexlist[edgelist[i].vertex1].Y) +
-		    (vertexlist[edgelist[i].vertex0].Z - vertexlist[edgelist[i].vertex1].Z) *
-		    (vertexlist[edgelist[i].vertex0].Z - vertexlist[edgelist[i].vertex1].Z)) > options.linelen_threshold)) {
-			Zoffset0=(long)(options.z_pad * (vertexlist[edgelist[i].vertex0].Z - midZ) / (maxZ - minZ));
-			Zoffset1=(long)(options.z_pad * (vertexlist[edgelist[i].vertex1].Z - midZ) / (maxZ - minZ));
-			
-			bresline(image, imagewidth, imageheight,
-			         (long)((vertexlist[edgelist[i].vertex0].X - minX)/options.scaledown + options.image_pad + options.z_pad + (float)(Zoffset0 * Z_Xdir)),
-				 (long)((vertexlist[edgelist[i].vertex0].Y - minY)/options.scaledown + options.image_pad + options.z_pad + (float)(Zoffset0 * Z_Ydir)),
-				 (long)((vertexlist[edgelist[i].vertex1].X - minX)/options.scaledown + options.image_pad + options.z_pad + (float)(Zoffset1 * Z_Xdir)),
-				 (long)((vertexlist[edgelist[i].vertex1].Y - minY)/options.scaledown + options.image_pad + options.z_pad + (float)(Zoffset1 * Z_Ydir)),
-				 drawcol);
-		} else {
-			k++;
+		ed_flat[n] = tempf;
+		ed_area[n] = usearea;
+		v0 = vertexlist[edgelist[i].vertex0];
+		v1 = vertexlist[edgelist[i].vertex1];
+		ed_len2[n] = (v0.X - v1.X) * (v0.X - v1.X) + (v0.Y - v1.Y) * (v0.Y - v1.Y) + (v0.Z - v1.Z) * (v0.Z - v1.Z);
+	} /* for numdraw */
+
+	/* Then the test itself, over the whole list at once */
+	numkeep = classify_edges(numdraw, ed_flat, ed_area, ed_len2, &options, keep, counts);
+	stats.culled_flat = counts[0];
+	stats.culled_area = counts[1];
+	stats.culled_length = counts[2];
+
+	for (n=0; n<numkeep; n++) {
+		i = (drawlist != NULL) ? drawlist[keep[n]] : keep[n];
+		switch (options.color_mode) {
+			case COLOR_NORMAL:
+				/* world axes to red, green, blue */
+				x = edge_face[i];
+				if (x >= 0) {
+					vect = planelist[facelist[x].plane_id].normal;
+					tempf = fmax(fabs(vect.X), fmax(fabs(vect.Y), fabs(vect.Z)));
+					if (tempf <= 0.0)
+						tempf = 1.0;
+					color = make_color(&canvas, fabs(vect.X) / tempf, fabs(vect.Y) / tempf, fabs(vect.Z) / tempf, level);
+				} else {
+					color = make_color(&canvas, 1.0, 1.0, 1.0, level / 2.0);
+				}
+				break;
+
+			case COLOR_HEIGHT:
+				tempf = (vertexlist[edgelist[i].vertex0].Z + vertexlist[edgelist[i].vertex1].Z) / 2.0;
+				color = ramp_color(&canvas, (zhi > zlo) ? (tempf - zlo) / (zhi - zlo) : 0.5, level);
+				break;
+
+			case COLOR_MODEL:
+				/* the world grey, brush models cycle through the ramp */
+				x = (edge_face[i] >= 0) ? face_model[edge_face[i]] : 0;
+				if (x == 0)
+					color = make_color(&canvas, 1.0, 1.0, 1.0, level / 2.0);
+				else
+					color = ramp_color(&canvas, (float)((x * 5) % 8) / 7.0, level);
+				break;
+
+			case COLOR_VIS:
+				/* a heatmap: the share of the viewpoints that see it */
+				x = edge_face[i];
+				if (x >= 0)
+					color = ramp_color(&canvas, (float)face_seen[x] / (float)numviews, level);
+				else
+					color = make_color(&canvas, 1.0, 1.0, 1.0, level / 2.0);
+				break;
+
+			case COLOR_DIFF:
+				color = diff_color(&canvas, edge_diff[i], level);
+				break;
+
+			default:
+				break;
 		}
-	} /* for numedges */
 
-	stdprintf("%ld edges plotted",numedges);
+		/* (in no layer, nowhere to draw it) */
+		lay = (edge_lay != NULL) ? edge_lay[i] : 1;
+		if (lay == 0)
+			continue;
+		seg[numseg].v0 = edgelist[i].vertex0;
+		seg[numseg].v1 = edgelist[i].vertex1;
+		seg[numseg].color = color;
+		seg[numseg].layers = lay;
+		numseg++;
+	} /* for numkeep */
+
+	stats.edges = numdraw;
+	k = stats.culled_flat + stats.culled_area + stats.culled_length;
+	stdprintf("%ld edges plotted",numdraw);
 	if(options.edgeremove) {
 		stdprintf(" (%ld edges removed)\n",k);
 	} else {
 		stdprintf("\n");
 	}
 
+	/* Join edges sharing a vertex into chains and drop the points in the
+	   middle of straight runs: long walls are split into many collinear
+	   edges, and drawing each one separately costs time and puts a
+	   doubled (bright) pixel at every joint */
+	pts = malloc(sizeof(long) * (numseg * 2 + 1));
+	start = malloc(sizeof(long) * (numseg + 1));
+	chain_col = malloc(sizeof(unsigned int) * (numseg + 1));
+	chain_lay = malloc(sizeof(uint32_t) * (numseg + 1));
+	if (pts == NULL || start == NULL || chain_col == NULL || chain_lay == NULL) {
+		fprintf(stderr,"Error allocating line buffers.\n");
+		ret = 2;
+		goto cleanup;
+	}
+	numchains = make_chains(seg, numseg, numvertices, pts, start, chain_col, chain_lay);
+	if (numchains < 0) {
+		fprintf(stderr,"Error allocating line buffers.\n");
+		ret = 2;
+		goto cleanup;
+	}
+	/* simplify in place, packing the chains down */
+	for (x=0, k=0; x<numchains; x++) {
+		j = simplify_chain(&pts[start[x]], start[x+1] - start[x], sx, sy, options.merge_tol);
+		memmove(&pts[k], &pts[start[x]], sizeof(long) * j);
+		start[x] = k;
+		k += j;
+	}
+	start[numchains] = k;
+	stats.lines = numchains;
+	stdprintf("%ld edges joined into %ld lines of %ld segments.\n",numseg,numchains,k - numchains);
+
+	if (!options.write_svg && (vert_done = calloc(numvertices + 1, sizeof(uint32_t))) == NULL) {
+		fprintf(stderr,"Error allocating line buffers.\n");
+		ret = 2;
+		goto cleanup;
+	}
+	for (x=0; x<numchains && !options.write_svg; x++) {
+		if ((x & 255) == 0) {
+			if (cancelled)
+				break;
+			progress("draw", x, numchains);
+		}
+		/* on the image of each layer the line is in */
+		for (l=0; l<numlayers; l++) {
+			lay = (1u << l);
+			if (!(chain_lay[x] & lay))
+				continue;
+			cv = &layer[l];
+
+			/* lines leave out their end points, which are drawn once here */
+			for (j=start[x]; j<start[x+1]; j++) {
+				if (vert_done[pts[j]] & lay)
+					continue;
+				vert_done[pts[j]] |= lay;
+				sp0 = &spt[pts[j]];
+				plotdepth(cv, zbuf, sp0->x, sp0->y, sp0->z, chain_col[x]);
+			}
+			for (j=start[x]; j<start[x+1]-1; j++) {
+				if (!options.use_region && !clip_lines) {
+					sp0 = &spt[pts[j]];
+					sp1 = &spt[pts[j+1]];
+					bresline(cv, zbuf, sp0->x, sp0->y, sp0->z, sp1->x, sp1->y, sp1->z, chain_col[x]);
+					continue;
+				}
+
+				/* only the part inside the image; the map around a region
+				   (or seen close up in perspective) can be far bigger */
+				fx0 = sx[pts[j]];   fy0 = sy[pts[j]];   fz0 = vertexlist[pts[j]].Z;
+				fx1 = sx[pts[j+1]]; fy1 = sy[pts[j+1]]; fz1 = vertexlist[pts[j+1]].Z;
+				if (!clip_line(&fx0, &fy0, &fz0, &fx1, &fy1, &fz1, -1.0, -1.0, (float)imagewidth, (float)imageheight))
+					continue;
+				bresline(cv, zbuf, (long)floor(fx0), (long)floor(fy0), fz0, (long)floor(fx1), (long)floor(fy1), fz1, chain_col[x]);
+			}
+		}
+	}
+
+	if (!options.write_svg)
+		progress("draw", numchains, numchains);
+
+	/* Entity markers on top -  -  -  -  -  -  -  -  -  -  -  -  -  -  -   */
+	if (options.entity_overlay && !cancelled) {
+		stdprintf("Marking entities...");
+		entp = (char *)bsp->data + bsp_header.entities.offset;
+		entend = entp + bsp_header.entities.size;
+		k = 0;
+		while ((entp = next_entity(entp, entend, &ent)) != NULL) {
+			x = entity_marker(&ent);
+			if (x == MARK_NONE)
+				continue;
+
+			/* brush entities sit in the middle of their model */
+			if (ent.model > 0 && ent.model < nummodels) {
+				v0.X = modellist[ent.model].origin.X + (modellist[ent.model].bound_min.X + modellist[ent.model].bound_max.X) / 2.0;
+				v0.Y = modellist[ent.model].origin.Y + (modellist[ent.model].bound_min.Y + modellist[ent.model].bound_max.Y) / 2.0;
+				v0.Z = modellist[ent.model].origin.Z + (modellist[ent.model].bound_min.Z + modellist[ent.model].bound_max.Z) / 2.0;
+			} else if (ent.has_origin) {
+				v0 = ent.origin;
+			} else {
+				continue;
+			}
+			/* on the layer it stands in */
+			lay = (edge_lay != NULL) ? layer_mask(v0.Z, v0.Z, bound, numlayers) : 1;
+			if (!options.free_camera)
+				to_camera(&v0, options.camera_axis);
+			else if (!camera_point(&cam, &v0))
+				continue;
+
+			Zoffset0=(long)(options.z_pad * (v0.Z - midZ) / (maxZ - minZ));
+			for (l=0; l<numlayers; l++) {
+				if (!(lay & (1u << l)))
+					continue;
+				draw_marker(&layer[l],
+				            (long)((v0.X - minX)/options.scaledown + options.image_pad + options.z_pad + (float)(Zoffset0 * Z_Xdir)) - org_x,
+				            (long)((v0.Y - minY)/options.scaledown + options.image_pad + options.z_pad + (float)(Zoffset0 * Z_Ydir)) - org_y,
+				            (int)x);
+			}
+			k++;
+		}
+		stdprintf("%ld entities marked.\n",k);
+	}
+
   /*
 	// Little gradient
 	for (i=0;i<=255;i++) {
@@ -1219,38 +5168,91 @@ maxX = maxY = maxZ = 4096;
 	}
   */
 
-	/* Negate image if necessary */
-	if (options.negative_image) {
-		for (i=0;i<imageheight;i++) {
-			for (j=0;j < imagewidth; j++) {
-				image[i * imagewidth + j] = 255 - image[i * imagewidth + j];
-			}
-		}
+	stats.stage[STAGE_RASTERIZE] += timer() - t0;
+	t0 = timer();
+
+	if (cancelled)
+		goto cleanup;
+
+	/* Negating, levels, gamma and thick lines are done row by row as the
+	   image is written out, so it is only read the once */
+	make_lut(lut, &options);
+	if (!options.write_svg && (rowbuf = malloc(imagewidth * bpp * 2)) == NULL) {
+		fprintf(stderr,"Error allocating row buffer.\n");
+		ret = 2;
+		goto cleanup;
 	}
 
-	/* Write image */
-	outfile=fopen(options.outf_name,"wb");
+	/* Write image (with layers, each in turn) */
+	outname0 = options.outf_name;
+next_layer:
+	if (edge_lay != NULL) {
+		canvas = layer[layer_at];
+		layer_name(layer_out, sizeof(layer_out), outname0, layer_at + 1);
+		options.outf_name = layer_out;
+	}
+	if (options.frames > 0 && frame > 0)
+		;  /* still open from the first frame */
+	else if (is_stdio(options.outf_name))
+		outfile = stdout;
+	else
+		outfile=fopen(options.outf_name,"wb");
 	if (outfile == NULL) {
 		fprintf(stderr,"Error opening output file %s.\n",options.outf_name);
-		return 1;
+		ret = 1;
+		goto cleanup;
 	}
 
-	if (options.write_raw) {
-		i=fwrite(image,sizeof(eightbit) * imagewidth * imageheight, 1,outfile);
-		if (i != 1) {
-			fprintf(stderr,"Error writing raw data to %s\n",options.outf_name);
-			return 1;
+	if (options.write_svg) {
+		if (write_svg(outfile, &options, imagewidth, imageheight, lut, pts, start, numchains, sx, sy, chain_col)) {
+			fprintf(stderr,"Error writing svg data to %s\n",options.outf_name);
+			ret = 1;
+			goto cleanup;
+		}
+	} else if (options.frames > 0) {
+		/* Y4M, greyscale: a header, then each frame's rows top down */
+		if (frame == 0)
+			fprintf(outfile, "YUV4MPEG2 W%ld H%ld F25:1 Ip A1:1 Cmono\n", imagewidth, imageheight);
+		fprintf(outfile, "FRAME\n");
+		for (j=0; j<imageheight && !cancelled; j++) {
+			t1 = timer();
+			finish_row(&canvas, j, lut, options.thick_lines, 0, &rowbuf[imagewidth * bpp], rowbuf);
+			stats.stage[STAGE_POSTPROC] += timer() - t1;
+			if (fwrite(rowbuf, sizeof(eightbit) * imagewidth, 1, outfile) != 1) {
+				fprintf(stderr,"Error writing frame to %s\n",options.outf_name);
+				ret = 1;
+				goto cleanup;
+			}
+		}
+	} else if (options.write_raw) {
+		for (j=0; j<imageheight; j++) {
+			if ((j & 63) == 0) {
+				if (cancelled)
+					break;
+				progress("write", j, imageheight);
+			}
+			t1 = timer();
+			finish_row(&canvas, j, lut, options.thick_lines, 0, &rowbuf[imagewidth * bpp], rowbuf);
+			stats.stage[STAGE_POSTPROC] += timer() - t1;
+			if (fwrite(rowbuf, sizeof(eightbit) * imagewidth * bpp, 1, outfile) != 1) {
+				fprintf(stderr,"Error writing raw data to %s\n",options.outf_name);
+				ret = 1;
+				goto cleanup;
+			}
 		}
 	} else {
 		/* Silly header - 54-byte header */
-		/* (14 fileheader, 40 infoheader), 1024-byte palette */
+		/* (14 fileheader, 40 infoheader), 1024-byte palette for 8-bit */
+		/* Rows are padded to 4 bytes */
+		k = (4 - ((imagewidth * bpp) % 4)) % 4;
+		x = (bpp == 1) ? 1024 : 0;
 
 		bmpfileheader.filetype[0]=(eightbit)0x42;
 		bmpfileheader.filetype[1]=(eightbit)0x4d;
-		bmpfileheader.filesize=(long)sizeof(eightbit) * (long)imagewidth * (long)imageheight + (long)1024 + (long)54;
+		bmpfileheader.filesize=(long)(imagewidth * bpp + k) * (long)imageheight + x + (long)54;
 		bmpfileheader.unused1=(unsigned short)0x0000;
 		bmpfileheader.unused2=(unsigned short)0x0000;
-		bmpfileheader.data_ofs=(long)(1024 + 54);
+		bmpfileheader.data_ofs=(long)(x + 54);
 		
 		// stdprintf("bfh.fs=%ld\n",bmpfileheader.filesize);
 		// stdprintf("sizesum = %d\n",sizeof(unsigned short) + sizeof(long) + sizeof(unsigned short) + sizeof(unsigned short) + sizeof(long));
@@ -1259,7 +5261,7 @@ maxX = maxY = maxZ = 4096;
 		bmpinfoheader.imagewidth=(long)imagewidth;
 		bmpinfoheader.imageheight=(long)imageheight;
 		bmpinfoheader.planes=(unsigned short)01;
-		bmpinfoheader.bitcount=(unsigned short)8; /* 8-bits, 256-color image */
+		bmpinfoheader.bitcount=(unsigned short)(bpp * 8); /* 8-bits, 256-color image, or 24-bit RGB */
 		bmpinfoheader.compression=(long)0x00000000; /* No compression */
 		//bmpinfoheader.datasize=(long)(sizeof(eightbit) * imagewidth * imageheight); /* Could put 0, since its valid for uncompressed image */
 		bmpinfoheader.datasize=(long)0x00000000;
@@ -1267,8 +5269,8 @@ maxX = maxY = maxZ = 4096;
 		bmpinfoheader.ypelspermeter=(long)0x00006338;
 		bmpinfoheader.xpelspermeter=(long)0x00000b6d; /* ImageMagick value :) */
 		bmpinfoheader.ypelspermeter=(long)0x00000b6d;
-		bmpinfoheader.colsused=(long)0x00000100; /* 256 colors */
-		bmpinfoheader.colsimportant=(long)0x00000100;
+		bmpinfoheader.colsused=(long)((bpp == 1) ? 0x00000100 : 0); /* 256 colors */
+		bmpinfoheader.colsimportant=(long)((bpp == 1) ? 0x00000100 : 0);
 		// stdprintf("sizeof(bfh_t) = %d\n",sizeof(bmp_fileheader_t));
 		// stdprintf("sizeof(bih_t) = %d\n",sizeof(bmp_infoheader_t));
 
@@ -1278,37 +5280,40 @@ maxX = maxY = maxZ = 4096;
 		i = 0;
 		i = i + fwrite(&(bmpfileheader.filetype[0]), sizeof(eightbit),1,outfile);
 		i = i + fwrite(&(bmpfileheader.filetype[1]), sizeof(eightbit),1,outfile);
-		i = i + fwrite(&bmpfileheader.filesize, sizeof(long),1,outfile);
-		i = i + fwrite(&bmpfileheader.unused1, sizeof(unsigned short),1,outfile);
-		i = i + fwrite(&bmpfileheader.unused2, sizeof(unsigned short),1,outfile);
-		i = i + fwrite(&bmpfileheader.data_ofs, sizeof(long),1,outfile);
+		i = i + put_long(outfile, bmpfileheader.filesize);
+		i = i + put_short(outfile, bmpfileheader.unused1);
+		i = i + put_short(outfile, bmpfileheader.unused2);
+		i = i + put_long(outfile, bmpfileheader.data_ofs);
 		if (i != 6) {
 			fprintf(stderr,"Error writing bmp file header.\n");
-			return 1;
+			ret = 1;
+			goto cleanup;
 		}
 
 		/* OLD:
 		i=fwrite(&bmpinfoheader,sizeof(bmp_infoheader_t),1,outfile);
 		*/
 		i = 0;
-		i = i + fwrite(&bmpinfoheader.headersize,sizeof(long),1,outfile);
-		i = i + fwrite(&bmpinfoheader.imagewidth,sizeof(long),1,outfile);
-		i = i + fwrite(&bmpinfoheader.imageheight,sizeof(long),1,outfile);
-		i = i + fwrite(&bmpinfoheader.planes,sizeof(unsigned short),1,outfile);
-		i = i + fwrite(&bmpinfoheader.bitcount,sizeof(unsigned short),1,outfile);
-		i = i + fwrite(&bmpinfoheader.compression,sizeof(long),1,outfile);
-		i = i + fwrite(&bmpinfoheader.datasize,sizeof(long),1,outfile);
-		i = i + fwrite(&bmpinfoheader.xpelspermeter,sizeof(long),1,outfile);
-		i = i + fwrite(&bmpinfoheader.ypelspermeter,sizeof(long),1,outfile);
-		i = i + fwrite(&bmpinfoheader.colsused,sizeof(long),1,outfile);
-		i = i + fwrite(&bmpinfoheader.colsimportant,sizeof(long),1,outfile);
+		/* (4-byte little-endian fields, whatever size a long is here) */
+		i = i + put_long(outfile, bmpinfoheader.headersize);
+		i = i + put_long(outfile, bmpinfoheader.imagewidth);
+		i = i + put_long(outfile, bmpinfoheader.imageheight);
+		i = i + put_short(outfile, bmpinfoheader.planes);
+		i = i + put_short(outfile, bmpinfoheader.bitcount);
+		i = i + put_long(outfile, bmpinfoheader.compression);
+		i = i + put_long(outfile, bmpinfoheader.datasize);
+		i = i + put_long(outfile, bmpinfoheader.xpelspermeter);
+		i = i + put_long(outfile, bmpinfoheader.ypelspermeter);
+		i = i + put_long(outfile, bmpinfoheader.colsused);
+		i = i + put_long(outfile, bmpinfoheader.colsimportant);
 		if (i != 11) {
 			fprintf(stderr,"Error writing bmp info header.\n");
-			return 1;
+			ret = 1;
+			goto cleanup;
 		}
 
 		/* Write the palette */
-		for(j=0; j<256; j++) {
+		for(j=0; j<256 && bpp == 1; j++) {
 			rgbquad.red    = (eightbit)j;
 			rgbquad.green  = (eightbit)j;
 			rgbquad.blue   = (eightbit)j;
@@ -1320,7 +5325,8 @@ maxX = maxY = maxZ = 4096;
 			i = i + fwrite(&rgbquad.unused,sizeof(eightbit),1,outfile);
 			if (i != 4) {
 				fprintf(stderr,"Error writing RGB Palette.\n");
-				return 1;
+				ret = 1;
+				goto cleanup;
 			}
 		}
 
@@ -1329,20 +5335,28 @@ maxX = maxY = maxZ = 4096;
 		// if (options.write_nocomp)
 		if (1) {
 			/* K is the amount to pad by */
-			k = sizeof(long) - ((sizeof(eightbit) * imagewidth) % sizeof(long));
-			k = (k == sizeof(long)) ? 0 : k;
 			for (j=1; j<=imageheight; j++) {
+				if ((j & 63) == 0) {
+					if (cancelled)
+						break;
+					progress("write", j, imageheight);
+				}
 				// Set of data: image[(int)((imageheight-j)*imagewidth)];  size = sizeof(eightbit) * (imagewidth)
-				i=fwrite(&image[(int)((imageheight-j)*imagewidth)], sizeof(eightbit) * (imagewidth), 1, outfile);
+				t1 = timer();
+				finish_row(&canvas, imageheight-j, lut, options.thick_lines, 1, &rowbuf[imagewidth * bpp], rowbuf);
+				stats.stage[STAGE_POSTPROC] += timer() - t1;
+				i=fwrite(rowbuf, sizeof(eightbit) * imagewidth * bpp, 1, outfile);
 				if (i != 1) {
 					fprintf(stderr,"Error writing bmp data to %s at line %ld\n",options.outf_name,j);
-					return 1;
+					ret = 1;
+					goto cleanup;
 				}
 
 				if (k > 0) {
 					if(fwrite(&pad,k,1,outfile) != 1) {
 						fprintf(stderr,"Error writing bmp data padding to %s at line %ld\n",options.outf_name,j);
-						return 1;
+						ret = 1;
+						goto cleanup;
 					}
 				}
 			} /* for */
@@ -1350,25 +5364,297 @@ maxX = maxY = maxZ = 4096;
 			/* TODO: Write compressed file? */
 		}
 	} 
+
+	/* a half written file is no use to anyone */
+	if (cancelled) {
+		if (outfile != stdout) {
+			fclose(outfile);
+			unlink(options.outf_name);
+		}
+		outfile = NULL;
+		goto cleanup;
+	}
+
+	/* Next frame: the per-frame buffers go, the image is kept, and the
+	   map is put back as it was before the camera moved it */
+	if (options.frames > 0 && ++frame < options.frames) {
+		free(vflag);     vflag = NULL;
+		free(sx);        sx = NULL;
+		free(sy);        sy = NULL;
+		free(spt);       spt = NULL;
+		free(zbuf);      zbuf = NULL;
+		free(edge_face); edge_face = NULL;
+		free(face_model); face_model = NULL;
+		free(seg);       seg = NULL;
+		free(ed_flat);   ed_flat = NULL;
+		free(ed_area);   ed_area = NULL;
+		free(ed_len2);   ed_len2 = NULL;
+		free(keep);      keep = NULL;
+		free(pts);       pts = NULL;
+		free(start);     start = NULL;
+		free(chain_col); chain_col = NULL;
+		free(chain_lay); chain_lay = NULL;
+		free(vert_done); vert_done = NULL;
+		free(rowbuf);    rowbuf = NULL;
+		numseg = 0;
+
+		numvertices = numverts0;
+		memcpy(vertexlist, world, sizeof(struct vertex_t) * numvertices);
+		memcpy(edgelist, edges0, sizeof(struct edge_t) * numedges);
+		numdraw = numdraw0;
+		if (draw0 != NULL) {
+			memcpy(drawlist, draw0, sizeof(long) * numdraw);
+		} else {
+			free(drawlist);
+			drawlist = NULL;
+		}
+		goto next_frame;
+	}
+	if (frames_hook != NULL) {
+		frames_hook("frames", options.frames, options.frames);
+		progress_hook = frames_hook;
+	}
+	if (!options.write_svg && options.frames == 0)
+		progress("write", imageheight, imageheight);
 	
 	stdprintf("File written to %s.\n",options.outf_name);
-	fclose(outfile);
+	/* (a pipe can't tell how much went down it) */
+	x = ftell(outfile);
+	if (x > 0)
+		stats.bytes += x;
+	if (outfile == stdout)
+		fflush(outfile);
+	else
+		fclose(outfile);
+	outfile = NULL;
+	if (edge_lay != NULL && ++layer_at < numlayers)
+		goto next_layer;
+
+	/* the height map, one for all the layers */
+	if (zmap != NULL) {
+		x = write_height(options.height_name, zmap, imagewidth, imageheight, zlo, zhi);
+		if (x < 0) {
+			fprintf(stderr,"Error writing height map to %s\n",options.height_name);
+			ret = 1;
+			goto cleanup;
+		}
+		stats.bytes += x;
+		stdprintf("Height map written to %s.\n",options.height_name);
+	}
+	/* less the post-processing done on the way */
+	stats.stage[STAGE_ENCODE] += timer() - t0 - stats.stage[STAGE_POSTPROC];
 
 	/* Close, done! */
+cleanup:
+	if (outfile != NULL && outfile != stdout) {
+		fclose(outfile);
+		/* a frame of a turntable may be out already */
+		if (cancelled)
+			unlink(options.outf_name);
+	}
+	free(rowbuf);
 	free(vertexlist);
 	free(edgelist);
 	free(ledges);
 	free(facelist);
+	free(modellist);
+	free(planelist);
+	if (zbuf != NULL)
+		free(zbuf);
+	free(zmap);
+	free(edge_face);
+	free(face_model);
+	free(face_seen);
+	free(seg);
+	free(ed_flat);
+	free(ed_area);
+	free(ed_len2);
+	free(keep);
+	free(sx);
+	free(sy);
+	free(spt);
+	free(pts);
+	free(start);
+	free(chain_col);
+	free(vert_done);
+	free(texinfolist);
+	free(texnames);
 	free(image);
+	if (face_sel != NULL) {
+		free(tex_drop);
+		free(model_sel);
+		free(face_sel);
+		free(edge_seen);
+	}
+	free(drawlist);
+	free(vflag);
+	free(world);
+	free(edges0);
+	free(draw0);
+	free(edge_diff);
+	free(floors);
+	free(facex);
+	free(facey);
+	free(facez);
+	free(edge_lay);
+	free(face_lay);
+	free(chain_lay);
+	for (l=1; l<numlayers; l++)
+		free(layer[l].image);
 	if (options.edgeremove) {
 		free(edge_extra);
 	}
 
-	if (options.write_raw) {
-		stdprintf("\nIf you want to (and have ImageMagick's convert):\n  convert -verbose -colors 256 -size %ldx%ld gray:%s map.jpg\n",imagewidth,imageheight,options.outf_name);
+	if (ret != 0)
+		return ret;
+	if (cancelled) {
+		fprintf(stderr,"\nCancelled, %s not written.\n",options.outf_name);
+		return 3;
+	}
+
+	if (options.write_svg) {
+		stdprintf("\n");
+	} else if (options.frames > 0) {
+		stdprintf("\nIf you want to (and have ffmpeg):\n  ffmpeg -i %s map.mp4\n\n",options.outf_name);
+	} else if (options.write_raw) {
+		stdprintf("\nIf you want to (and have ImageMagick's convert):\n  convert -verbose -colors 256 -depth 8 -size %ldx%ld %s:%s map.jpg\n",imagewidth,imageheight,(bpp == 3) ? "rgb" : "gray",options.outf_name);
 	} else {
 		stdprintf("\nIf you want to (and have ImageMagick's convert):\n  convert -verbose -colors 256 bmp:%s map.jpg\n\n",options.outf_name);
 	}
 
+	if (options.stats != STATS_NONE)
+		report_stats((is_stdio(options.outf_name) || is_stdio(options.height_name)) ? stderr : stdout, options.stats, bsp->name, bsp->entry, options.outf_name);
+
 	return 0;
 }
+
+/*===========================================================================*/
+
+int main(int argc, char *argv[]) {
+	struct options_t      options;
+	struct bspdata_t      bsp, mapbsp;
+	struct archive_t      arc;
+	struct arcentry_t     ent;
+	char                 *outdir, *hname;
+	long                  pos, len;
+	int                   err=0, ret=0, nummaps=0;
+	double                t0;
+
+	/* Enough args? */
+	if (argc < 2) {
+		show_help();
+		return 1;
+	}
+
+	/* Setup options */
+	def_options(&options);
+	get_options(&options,argc,argv);
+	/* the image goes to stdout, the chatter mustn't; a bsp from stdin
+	   goes there too unless told otherwise */
+	if (from_stdin(options.bspf_name) && options.outf_name == NULL)
+		options.outf_name = "-";
+	if (is_stdio(options.outf_name) && is_stdio(options.height_name)) {
+		fprintf(stderr,"Only one of the image and the height map can go to stdout.\n");
+		return 1;
+	}
+	if (is_stdio(options.outf_name) || is_stdio(options.height_name))
+		quiet = 1;
+	show_options(&options);
+
+	if (options.bspf_name == NULL) {
+		show_help();
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if (options.progress)
+		progress_hook = show_progress;
+
+	memset(&stats, 0, sizeof(stats));
+	t0 = timer();
+	if (open_bsp(options.bspf_name, &bsp)) {
+		fprintf(stderr,"Error opening bsp file %s.\n",options.bspf_name);
+		return 1;
+	}
+	stats.stage[STAGE_LOAD] = timer() - t0;
+
+	/* A whole archive: render every map in it */
+	if (bsp.entry[0] == '\0' && open_archive(&arc, bsp.data, bsp.size) != ARC_NONE) {
+		/* (which includes an archive from stdin, with no outfile given) */
+		if (is_stdio(options.outf_name)) {
+			fprintf(stderr,"Every map in %s can't go to stdout: give an output directory, or pick one map as %s:maps/e1m1.bsp.\n",options.bspf_name,options.bspf_name);
+			close_bsp(&bsp);
+			return 1;
+		}
+		if (is_stdio(options.height_name)) {
+			fprintf(stderr,"The height maps of every map in %s can't go to stdout: use -H with a file name (each is written next to its image), or pick one map as %s:maps/e1m1.bsp.\n",options.bspf_name,options.bspf_name);
+			close_bsp(&bsp);
+			return 1;
+		}
+		outdir = options.outf_name;
+		hname = options.height_name;
+		for (pos = arc.dirofs; !cancelled && (pos = next_entry(&arc, pos, &ent)) >= 0; ) {
+			len = strlen(ent.name);
+			if (len < 9 || strncasecmp(ent.name, "maps/", 5) != 0 || strcasecmp(&ent.name[len-4], ".bsp") != 0)
+				continue;
+
+			nummaps++;
+			strcpy(mapbsp.name, bsp.name);
+			strcpy(mapbsp.entry, ent.name);
+			options.outf_name = make_outname(mapbsp.name, mapbsp.entry, outdir, options.write_svg ? ".svg" : (options.frames > 0) ? ".y4m" : ".bmp");
+			/* one height map each, next to the image */
+			if (hname != NULL)
+				options.height_name = make_outname(mapbsp.name, mapbsp.entry, outdir, ".pgm");
+			if (options.outf_name == NULL || (hname != NULL && options.height_name == NULL)) {
+				fprintf(stderr,"Error allocating output name.\n");
+				free(options.outf_name);
+				if (options.height_name != hname)
+					free(options.height_name);
+				ret = 2;
+				break;
+			}
+			stdprintf("\n%s:%s -> %s\n",mapbsp.name,mapbsp.entry,options.outf_name);
+
+			memset(&stats, 0, sizeof(stats));
+			t0 = timer();
+			err = load_entry(&arc, &ent, &mapbsp);
+			stats.stage[STAGE_LOAD] = timer() - t0;
+			if (err == 0) {
+				err = render_bsp(&options, &mapbsp);
+				close_bsp(&mapbsp);
+			}
+			if (err) {
+				if (!cancelled)
+					fprintf(stderr,"Error rendering %s:%s.\n",mapbsp.name,mapbsp.entry);
+				ret = err;
+			}
+			free(options.outf_name);
+			if (options.height_name != hname)
+				free(options.height_name);
+		}
+		close_bsp(&bsp);
+
+		if (nummaps == 0) {
+			fprintf(stderr,"No maps found in %s.\n",options.bspf_name);
+			return 1;
+		}
+		return ret;
+	}
+
+	/* Create Output file name if it is not provided */
+	if (options.outf_name == NULL) {
+		options.outf_name = make_outname(bsp.name, (bsp.entry[0] != '\0') ? bsp.entry : NULL, NULL, options.write_svg ? ".svg" : (options.frames > 0) ? ".y4m" : ".bmp");
+		if (options.outf_name == NULL) {
+			fprintf(stderr,"Error allocating output name.\n");
+			close_bsp(&bsp);
+			return 2;
+		}
+		fprintf(stdout,"Assuming BMP name from BSP name: %s\n",options.outf_name);
+	}
+
+	ret = render_bsp(&options, &bsp);
+	close_bsp(&bsp);
+
+	return ret;
+}